@@ -0,0 +1,680 @@
+// See LICENSE for license details.
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "isc.h"
+#include "isc_capture.h"
+#include "isc_stub.h"
+#include "isc_uapi.h"
+#include "sample_uapi.h"
+
+#define LOGE(...) fprintf(stderr, __VA_ARGS__)
+
+#define BENCH_UID       isc_fourcc('b', 'e', 'n', '0')
+#define BENCH_MAX_SWEEP 16
+#define BENCH_CAP_SIZE  (256u << 20)
+#define BENCH_PULL_MAX  16 /* slots per recv_many() */
+#define BENCH_PULL_WAIT 10 /* ms, how soon a consumer notices the end */
+
+enum bench_dir {
+    BENCH_U2K = 1,
+    BENCH_K2U = 2,
+};
+
+struct bench_sweep {
+    uint32_t v[BENCH_MAX_SWEEP];
+    uint32_t n;
+};
+
+struct bench_cfg {
+    enum bench_dir dir;
+    uint32_t msz, num, listeners, handles, producers;
+    uint32_t count;
+};
+
+struct bench_run;
+
+struct bench_listener {
+    struct bench_run *run;
+    uint32_t idx;
+};
+
+struct bench_run {
+    struct bench_cfg cfg;
+    struct isc_session *sess;
+    struct isc_handle **isc;
+    struct bench_listener *li;
+    uint64_t *lat;
+    atomic_uint nlat;
+    atomic_uint got;
+    atomic_uint_fast64_t t_last;
+    atomic_uint failed;
+    atomic_bool stop;
+    atomic_bool calm; /* -K: the producers are done */
+    atomic_uint flaps;
+};
+
+struct bench_producer {
+    struct bench_run *run;
+    uint32_t idx;
+    pthread_t tid;
+};
+
+static bool use_dev;
+static bool use_legacy;
+static bool use_session;
+static bool use_buf;
+static uint32_t pull_threads;
+static uint32_t flap_usecs;
+static struct isc_opts opts;
+static int opt_cpus[BENCH_MAX_SWEEP];
+static uint32_t uid_base = BENCH_UID;
+
+static inline uint64_t bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* consecutive handles differ in the last fourcc character, e.g. sam0, sam1 */
+static inline uint32_t bench_uid(uint32_t i)
+{
+    return uid_base + (i << 24);
+}
+
+static int32_t bench_got(void *msg, uint32_t len, void *arg)
+{
+    struct bench_listener *li = (struct bench_listener *)arg;
+    struct bench_run *run = li->run;
+    uint64_t now, t;
+    uint32_t n;
+
+    if (li->idx || len < sizeof(t))
+        return 0;
+
+    now = bench_now();
+    memcpy(&t, msg, sizeof(t));
+    n = atomic_fetch_add(&run->nlat, 1);
+    if (n < run->cfg.count)
+        run->lat[n] = now - t;
+    atomic_store(&run->t_last, now);
+    atomic_fetch_add(&run->got, 1);
+    return 0;
+}
+
+static const struct isc_listener_ops bench_listener_ops = {
+    .got = bench_got,
+};
+
+/* -P: an application thread draining one handle with recv_many() */
+static void *bench_consumer_task(void *arg)
+{
+    struct bench_producer *c = (struct bench_producer *)arg;
+    struct bench_run *run = c->run;
+    uint32_t h = c->idx / pull_threads;
+    struct bench_listener *li = &run->li[h * run->cfg.listeners];
+    struct isc_slot slots[BENCH_PULL_MAX];
+    struct isc_handle *isc = run->isc[h];
+    int i, n;
+
+    while (!atomic_load(&run->stop)) {
+        n = isc->recv_many(isc, slots, BENCH_PULL_MAX, BENCH_PULL_WAIT);
+        if (n < 0)
+            break;
+        for (i = 0; i < n; i++) {
+            bench_got(slots[i].data, slots[i].len, li);
+            isc->release(isc, &slots[i], 0);
+        }
+    }
+    return NULL;
+}
+
+/* -K: the peers of all handles go away for flap_usecs out of every five */
+static void *bench_flapper_task(void *arg)
+{
+    struct bench_run *run = (struct bench_run *)arg;
+    uint32_t i;
+
+    while (!atomic_load(&run->calm)) {
+        usleep(4 * flap_usecs);
+        for (i = 0; i < run->cfg.handles; i++)
+            isc_stub_set_link(bench_uid(i), false);
+        usleep(flap_usecs);
+        for (i = 0; i < run->cfg.handles; i++)
+            isc_stub_set_link(bench_uid(i), true);
+        atomic_fetch_add(&run->flaps, 1);
+    }
+    return NULL;
+}
+
+static void bench_fill(struct bench_run *run, uint8_t *buf)
+{
+    struct sample_msg *sm = (struct sample_msg *)buf;
+    uint64_t t = bench_now();
+
+    /* the sample driver only understands its own messages */
+    if (use_dev && run->cfg.msz >= sizeof(*sm)) {
+        sm->id = SAMPLE_MSG_READ_REG;
+        sm->reg.offset = 0;
+        sm->reg.value = 0;
+        return;
+    }
+    memcpy(buf, &t, sizeof(t));
+}
+
+static void *bench_producer_task(void *arg)
+{
+    struct bench_producer *p = (struct bench_producer *)arg;
+    struct bench_run *run = p->run;
+    struct bench_cfg *cfg = &run->cfg;
+    uint32_t per = cfg->count / cfg->producers;
+    struct isc_handle *isc;
+    uint64_t t0;
+    int32_t result;
+    uint8_t *buf, *b;
+    uint32_t i, n, id;
+    int rc;
+
+    buf = (uint8_t *)calloc(1, cfg->msz);
+    if (!buf) {
+        atomic_fetch_add(&run->failed, per);
+        return NULL;
+    }
+
+    for (i = 0; i < per; i++) {
+        n = (p->idx + i * cfg->producers) % cfg->handles;
+        if (cfg->dir == BENCH_K2U) {
+            bench_fill(run, buf);
+            if (use_buf)
+                rc = isc_stub_post_buf(bench_uid(n), buf, cfg->msz);
+            else
+                rc = isc_stub_post(bench_uid(n), buf, cfg->msz);
+            if (rc < 0)
+                atomic_fetch_add(&run->failed, 1);
+            continue;
+        }
+
+        isc = run->isc[n];
+        t0 = bench_now();
+        if (use_buf) {
+            /* one-way buffers come back once the driver consumed them */
+            while (!(b = (uint8_t *)isc->buf_alloc(isc, &id)))
+                sched_yield();
+            bench_fill(run, b);
+            rc = isc->send_buf(isc, id, 0, cfg->msz, &result);
+            if (!(opts.flags & ISC_OPT_ONEWAY))
+                isc->buf_free(isc, id);
+        } else {
+            bench_fill(run, buf);
+            rc = isc->send(isc, buf, cfg->msz, &result);
+        }
+        if (rc < 0 || result < 0) {
+            atomic_fetch_add(&run->failed, 1);
+            continue;
+        }
+        run->lat[atomic_fetch_add(&run->nlat, 1)] = bench_now() - t0;
+    }
+
+    free(buf);
+    return NULL;
+}
+
+static void bench_close(struct bench_run *run)
+{
+    uint32_t i;
+
+    for (i = 0; run->isc && i < run->cfg.handles; i++)
+        if (run->isc[i])
+            run->isc[i]->close(run->isc[i]);
+    if (run->sess)
+        run->sess->close(run->sess);
+    free(run->isc);
+    free(run->li);
+    free(run->lat);
+}
+
+static int bench_open(struct bench_run *run)
+{
+    struct bench_cfg *cfg = &run->cfg;
+    struct isc_attr a = {cfg->msz, cfg->num};
+    struct isc_opts o = opts;
+    struct bench_listener *li;
+    uint32_t i, j;
+    int rc;
+
+    run->isc = (struct isc_handle **)calloc(cfg->handles, sizeof(*run->isc));
+    run->li = (struct bench_listener *)calloc(cfg->handles * cfg->listeners,
+                                              sizeof(*run->li));
+    run->lat = (uint64_t *)calloc(cfg->count, sizeof(*run->lat));
+    if (!run->isc || !run->li || !run->lat)
+        return -1;
+
+    if (use_buf) {
+        /* the queues only carry descriptors, each producer holds one more */
+        a.msz = sizeof(struct isc_buf_desc);
+        o.flags |= ISC_OPT_BUF;
+        o.buf_size = cfg->msz;
+        o.buf_num = cfg->num + cfg->producers;
+    }
+    if (pull_threads)
+        o.flags |= ISC_OPT_PULL;
+
+    if (use_session) {
+        /* both queues of every handle, each slot rounded up generously */
+        rc = open_isc_session(cfg->handles * 2 * cfg->num * (cfg->msz + 64),
+                              &opts, &run->sess);
+        if (rc < 0) {
+            LOGE("failed to call open_isc_session (rc=%d)\n", rc);
+            return rc;
+        }
+    }
+
+    for (i = 0; i < cfg->handles; i++) {
+        if (run->sess)
+            rc = run->sess->open(run->sess, bench_uid(i), &a, &a, &opts,
+                                 &run->isc[i]);
+        else
+            rc = open_isc_ex(bench_uid(i), &a, &a, &o, &run->isc[i]);
+        if (rc < 0) {
+            LOGE("failed to call open_isc (uid=0x%08x)\n", bench_uid(i));
+            return rc;
+        }
+
+        for (j = 0; j < cfg->listeners; j++) {
+            li = &run->li[i * cfg->listeners + j];
+            li->run = run;
+            li->idx = j;
+            rc = run->isc[i]->add_listener(run->isc[i], &bench_listener_ops,
+                                           li);
+            if (rc < 0)
+                return rc;
+        }
+    }
+    return 0;
+}
+
+static int bench_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t bench_pct(uint64_t *lat, uint32_t n, uint32_t permille)
+{
+    uint64_t i;
+
+    if (!n)
+        return 0;
+    i = (uint64_t)n * permille / 1000;
+    return lat[i < n ? i : n - 1];
+}
+
+static uint64_t bench_avg(const struct isc_hist *h)
+{
+    return h->count ? h->sum_ns / h->count : 0;
+}
+
+static void bench_report(struct bench_run *run, uint64_t ns)
+{
+    struct bench_cfg *cfg = &run->cfg;
+    uint32_t n = atomic_load(&run->nlat);
+    struct isc_delay_stat ds;
+    struct isc_queue_stat st;
+    double secs = ns / 1e9;
+    double mps;
+
+    /* the queue under test of the first handle */
+    memset(&ds, 0, sizeof(ds));
+    if (cfg->dir == BENCH_U2K) {
+        run->isc[0]->queue_stat(run->isc[0], &st, NULL);
+        run->isc[0]->delay_stat(run->isc[0], &ds, NULL);
+    } else {
+        run->isc[0]->queue_stat(run->isc[0], NULL, &st);
+        run->isc[0]->delay_stat(run->isc[0], NULL, &ds);
+    }
+
+    if (n > cfg->count)
+        n = cfg->count;
+    qsort(run->lat, n, sizeof(*run->lat), bench_cmp);
+    mps = secs > 0 ? n / secs : 0;
+
+    printf("{\"dir\":\"%s\",\"session\":%s,\"ring\":%s,\"oneway\":%s,"
+           "\"buf\":%s,\"pull\":%u,\"msz\":%u,\"num\":%u,"
+           "\"listeners\":%u,\"handles\":%u,\"producers\":%u,"
+           "\"msgs\":%u,\"failed\":%u,"
+           "\"secs\":%.6f,\"msgs_per_sec\":%.0f,\"bytes_per_sec\":%.0f,"
+           "\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,"
+           "\"num_end\":%u,\"hwm\":%u,\"resizes\":%u,"
+           "\"queue_avg_ns\":%llu,\"handler_avg_ns\":%llu,\"flaps\":%u}\n",
+           cfg->dir == BENCH_U2K ? "u2k" : "k2u",
+           use_session ? "true" : "false",
+           opts.flags & ISC_OPT_RING ? "true" : "false",
+           opts.flags & ISC_OPT_ONEWAY ? "true" : "false",
+           use_buf ? "true" : "false", pull_threads, cfg->msz, cfg->num,
+           cfg->listeners, cfg->handles, cfg->producers, n,
+           atomic_load(&run->failed), secs, mps, mps * cfg->msz,
+           (unsigned long long)bench_pct(run->lat, n, 500),
+           (unsigned long long)bench_pct(run->lat, n, 990),
+           (unsigned long long)bench_pct(run->lat, n, 999), st.num, st.hwm,
+           st.resizes, (unsigned long long)bench_avg(&ds.queue),
+           (unsigned long long)bench_avg(&ds.handler),
+           atomic_load(&run->flaps));
+    fflush(stdout);
+}
+
+static int bench_one(struct bench_cfg *cfg)
+{
+    struct bench_producer *p, *q = NULL;
+    struct bench_run run;
+    uint32_t i, total, nq = 0;
+    pthread_t flapper;
+    uint64_t t0, t1;
+    int rc;
+
+    memset(&run, 0, sizeof(run));
+    run.cfg = *cfg;
+    run.cfg.count -= cfg->count % cfg->producers;
+    total = run.cfg.count;
+
+    rc = bench_open(&run);
+    if (rc < 0) {
+        bench_close(&run);
+        return rc;
+    }
+
+    p = (struct bench_producer *)calloc(cfg->producers, sizeof(*p));
+    if (cfg->dir == BENCH_K2U && pull_threads) {
+        nq = cfg->handles * pull_threads;
+        q = (struct bench_producer *)calloc(nq, sizeof(*q));
+    }
+    if (!p || (nq && !q)) {
+        free(p);
+        bench_close(&run);
+        return -1;
+    }
+
+    for (i = 0; i < nq; i++) {
+        q[i].run = &run;
+        q[i].idx = i;
+        pthread_create(&q[i].tid, NULL, bench_consumer_task, &q[i]);
+    }
+
+    if (flap_usecs)
+        pthread_create(&flapper, NULL, bench_flapper_task, &run);
+
+    t0 = bench_now();
+    for (i = 0; i < cfg->producers; i++) {
+        p[i].run = &run;
+        p[i].idx = i;
+        pthread_create(&p[i].tid, NULL, bench_producer_task, &p[i]);
+    }
+    for (i = 0; i < cfg->producers; i++)
+        pthread_join(p[i].tid, NULL);
+    t1 = bench_now();
+
+    if (flap_usecs) {
+        /* sends held while the link was down go out once it is back */
+        atomic_store(&run.calm, true);
+        pthread_join(flapper, NULL);
+    }
+
+    if (cfg->dir == BENCH_U2K && (opts.flags & ISC_OPT_ONEWAY))
+        for (i = 0; i < cfg->handles; i++)
+            atomic_fetch_add(&run.failed,
+                             run.isc[i]->oneway_errors(run.isc[i]));
+
+    if (cfg->dir == BENCH_K2U) {
+        while (atomic_load(&run.got) + atomic_load(&run.failed) < total)
+            usleep(100);
+        if (atomic_load(&run.got))
+            t1 = atomic_load(&run.t_last);
+    }
+
+    atomic_store(&run.stop, true);
+    for (i = 0; i < nq; i++)
+        pthread_join(q[i].tid, NULL);
+
+    bench_report(&run, t1 - t0);
+    free(q);
+    free(p);
+    bench_close(&run);
+    return 0;
+}
+
+static int bench_parse_list(const char *s, struct bench_sweep *sw,
+                            bool allow_zero)
+{
+    char *end;
+
+    sw->n = 0;
+    while (*s && sw->n < BENCH_MAX_SWEEP) {
+        sw->v[sw->n] = strtoul(s, &end, 0);
+        if (end == s || (!allow_zero && !sw->v[sw->n]))
+            return -1;
+        sw->n++;
+        s = *end == ',' ? end + 1 : end;
+    }
+    return sw->n ? 0 : -1;
+}
+
+static int bench_parse(const char *s, struct bench_sweep *sw)
+{
+    return bench_parse_list(s, sw, false);
+}
+
+static int bench_parse_cpus(const char *s, struct bench_sweep *sw)
+{
+    return bench_parse_list(s, sw, true);
+}
+
+static void bench_usage(const char *name)
+{
+    LOGE("usage: %s [-d] [-L] [-S] [-R] [-o] [-T] [-B] [-U] [-z min,max]\n"
+         "       [-M usecs,msgs] [-P threads] [-K usecs,backlog] [-C file]\n"
+         "       [-a cpu,...] [-r prio] [-N node]\n"
+         "       [-u uid] [-c count] [-D u2k,k2u] [-m msz,...] [-n num,...]\n"
+         "       [-l listeners,...] [-H handles,...] [-p producers,...]\n"
+         "  -d  use /dev/isc instead of the built-in stand-in driver\n"
+         "  -L  make the stand-in answer like the first driver release\n"
+         "  -S  open all handles from one session\n"
+         "  -R  use the shared ring fast path (protocol v2)\n"
+         "  -o  send one-way, without waiting for the reply\n"
+         "  -T  timestamp messages, reports queueing and handler delay\n"
+         "  -B  move payloads through a buffer pool, msz may exceed 64K\n"
+         "  -U  receive on io_uring where the driver supports it\n"
+         "  -M  hold receive bursts up to usecs or msgs (0 for time only)\n"
+         "  -P  k2u consumer threads per handle calling recv_many()\n"
+         "  -K  unbind the peers for usecs out of every 5, hold one-way sends\n"
+         "  -z  let -R queues resize between min and max depth\n"
+         "  -C  capture all traffic to file, see isc-replay\n"
+         "  -a  CPUs of the receive threads, e.g. 2,3\n"
+         "  -r  run receive threads as SCHED_FIFO with this priority\n"
+         "  -N  bind queue memory to this NUMA node\n"
+         "  -u  uid of the first handle (default 0x%08x)\n"
+         "  -c  messages per run (default 100000)\n"
+         "Results are printed as one JSON object per run.\n",
+         name, BENCH_UID);
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench_sweep msz = {{16, 64, 256, 1024, 4096}, 5};
+    struct bench_sweep num = {{8, 64, 256}, 3};
+    struct bench_sweep lis = {{1, 4}, 2};
+    struct bench_sweep han = {{1, 8}, 2};
+    struct bench_sweep pro = {{1, 4}, 2};
+    uint32_t dirs = BENCH_U2K | BENCH_K2U;
+    struct bench_cfg cfg;
+    uint32_t d, a, b, c, e, f;
+    struct bench_sweep cpus;
+    uint32_t i;
+    int opt;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.count = 100000;
+
+    while ((opt = getopt(argc, argv,
+                         "dLSRoTBUz:M:P:K:C:u:c:D:m:n:l:H:p:a:r:N:h")) != -1) {
+        switch (opt) {
+        case 'd':
+            use_dev = true;
+            break;
+        case 'L':
+            use_legacy = true;
+            break;
+        case 'S':
+            use_session = true;
+            break;
+        case 'R':
+            opts.flags |= ISC_OPT_RING;
+            break;
+        case 'o':
+            opts.flags |= ISC_OPT_ONEWAY;
+            break;
+        case 'T':
+            opts.flags |= ISC_OPT_TS;
+            break;
+        case 'B':
+            use_buf = true;
+            break;
+        case 'U':
+            opts.flags |= ISC_OPT_URING;
+            break;
+        case 'z':
+            if (bench_parse(optarg, &cpus) < 0 || cpus.n != 2)
+                goto _usage;
+            opts.flags |= ISC_OPT_RESIZE;
+            opts.min_num = cpus.v[0];
+            opts.max_num = cpus.v[1];
+            break;
+        case 'M':
+            if (bench_parse_list(optarg, &cpus, true) < 0 || cpus.n != 2)
+                goto _usage;
+            opts.flags |= ISC_OPT_MODERATE;
+            opts.mod_usecs = cpus.v[0];
+            opts.mod_msgs = cpus.v[1];
+            break;
+        case 'P':
+            pull_threads = strtoul(optarg, NULL, 0);
+            break;
+        case 'K':
+            if (bench_parse_list(optarg, &cpus, true) < 0 || cpus.n != 2 ||
+                !cpus.v[0])
+                goto _usage;
+            flap_usecs = cpus.v[0];
+            opts.flags |= ISC_OPT_REBIND;
+            opts.backlog = cpus.v[1];
+            break;
+        case 'C':
+            if (isc_capture_start(optarg, BENCH_CAP_SIZE) < 0)
+                return -1;
+            break;
+        case 'a':
+            if (bench_parse_cpus(optarg, &cpus) < 0)
+                goto _usage;
+            for (i = 0; i < cpus.n; i++)
+                opt_cpus[i] = cpus.v[i];
+            opts.cpus = opt_cpus;
+            opts.ncpus = cpus.n;
+            break;
+        case 'r':
+            opts.policy = SCHED_FIFO;
+            opts.priority = strtol(optarg, NULL, 0);
+            break;
+        case 'N':
+            opts.flags |= ISC_OPT_NUMA;
+            opts.numa_node = strtol(optarg, NULL, 0);
+            break;
+        case 'u':
+            uid_base = strtoul(optarg, NULL, 0);
+            break;
+        case 'c':
+            cfg.count = strtoul(optarg, NULL, 0);
+            break;
+        case 'D':
+            dirs = 0;
+            if (strstr(optarg, "u2k"))
+                dirs |= BENCH_U2K;
+            if (strstr(optarg, "k2u"))
+                dirs |= BENCH_K2U;
+            break;
+        case 'm':
+            if (bench_parse(optarg, &msz) < 0)
+                goto _usage;
+            break;
+        case 'n':
+            if (bench_parse(optarg, &num) < 0)
+                goto _usage;
+            break;
+        case 'l':
+            if (bench_parse(optarg, &lis) < 0)
+                goto _usage;
+            break;
+        case 'H':
+            if (bench_parse(optarg, &han) < 0)
+                goto _usage;
+            break;
+        case 'p':
+            if (bench_parse(optarg, &pro) < 0)
+                goto _usage;
+            break;
+        default:
+            goto _usage;
+        }
+    }
+
+    if (!cfg.count || !dirs || (use_session && (use_buf || pull_threads)) ||
+        (use_dev && (flap_usecs || use_legacy)))
+        goto _usage;
+
+    if (!use_dev) {
+        isc_stub_install();
+        isc_stub_set_legacy(use_legacy);
+    } else if (dirs & BENCH_K2U) {
+        LOGE("k2u needs the stand-in driver to produce messages, skipped\n");
+        dirs &= ~BENCH_K2U;
+    }
+
+    for (d = BENCH_U2K; d <= BENCH_K2U; d <<= 1) {
+        if (!(dirs & d))
+            continue;
+        cfg.dir = (enum bench_dir)d;
+        for (a = 0; a < msz.n; a++)
+            for (b = 0; b < num.n; b++)
+                for (c = 0; c < lis.n; c++)
+                    for (e = 0; e < han.n; e++)
+                        for (f = 0; f < pro.n; f++) {
+                            cfg.msz = msz.v[a];
+                            cfg.num = num.v[b];
+                            cfg.listeners = lis.v[c];
+                            cfg.handles = han.v[e];
+                            cfg.producers = pro.v[f];
+                            if (cfg.msz < sizeof(uint64_t) ||
+                                (!use_buf && cfg.msz > UINT16_MAX) ||
+                                cfg.count < cfg.producers)
+                                continue;
+                            if (bench_one(&cfg) < 0) {
+                                isc_capture_stop();
+                                return -1;
+                            }
+                        }
+    }
+    isc_capture_stop();
+    return 0;
+
+_usage:
+    isc_capture_stop();
+    bench_usage(argv[0]);
+    return -1;
+}
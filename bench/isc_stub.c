@@ -0,0 +1,1112 @@
+// See LICENSE for license details.
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "isc_dev.h"
+#include "isc_uapi.h"
+
+#include "isc_stub.h"
+
+#ifndef ARRAY_SIZE
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(*(x)))
+#endif
+
+#define STUB_MAX_FILES 4096
+#define STUB_PAGE_SIZE 4096
+#define STUB_RING_SPIN 64
+#define STUB_ALIGN(x, a) (((x) + (a) - 1) & ~((a) - 1))
+#define STUB_BUF_OFF   (2 * STUB_PAGE_SIZE) /* after the two queues */
+
+struct stub_queue {
+    uint8_t *mem;
+    uint32_t size;
+    uint16_t msz, num;
+    uint32_t wp, rp, cnt;
+    struct isc_ring *ring; /* protocol v2 only */
+    uint32_t waiters;      /* posters blocked on a full v2 ring */
+    bool ts;               /* slots carry struct isc_msg_ts */
+    bool want;             /* ISC_FEAT_WANT granted */
+    bool keep;             /* ISC_FEAT_KEEP granted */
+};
+
+struct stub_file;
+
+struct stub_chan {
+    uint32_t uid;
+    uint32_t idx;
+    struct stub_queue q[2]; /* indexed by enum isc_bind_dir */
+    uint16_t seq;
+    uint32_t posted;
+    struct stub_file *file;
+    /* v2 sendq consumer, stands in for the driver kthread */
+    pthread_t consumer;
+    bool has_consumer, stop;
+    bool unbound; /* peer away, a kept sendq is not consumed meanwhile */
+};
+
+/*
+ * A plain file carries one channel in chans[0] whose queues are mapped
+ * one by one. A session file owns a pool, the channels live inside it.
+ */
+struct stub_file {
+    int fd;
+    int xfd; /* round-trips stand in for the kernel crossing of a request */
+    bool closed;
+    uint8_t *pool;
+    uint32_t pool_size, pool_used;
+    struct isc_pool_ctrl *ctrl;
+    struct isc_buf_ctrl *buf; /* plain files only */
+    uint64_t buf_size;
+    struct stub_chan *chans[ISC_SESSION_MAX];
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+static struct stub_file *stub_files[STUB_MAX_FILES];
+static pthread_mutex_t stub_lock = PTHREAD_MUTEX_INITIALIZER;
+static isc_stub_handler stub_handler;
+static bool stub_legacy;
+static void *stub_handler_arg;
+
+static inline uint32_t stub_slot_size(uint32_t msz, bool ts)
+{
+    return msz + sizeof(struct isc_msg) + (ts ? sizeof(struct isc_msg_ts) : 0);
+}
+
+static inline uint32_t stub_node_size(struct stub_queue *q)
+{
+    return stub_slot_size(q->msz, q->ts);
+}
+
+static inline uint64_t stub_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline struct isc_msg_ts *stub_msg_ts(struct isc_msg *m)
+{
+    return m->flags & ISC_MSG_FLAG_TS ? (struct isc_msg_ts *)m->d : NULL;
+}
+
+static inline void *stub_msg_data(struct isc_msg *m)
+{
+    return m->flags & ISC_MSG_FLAG_TS ? m->d + sizeof(struct isc_msg_ts)
+                                      : m->d;
+}
+
+static inline void *stub_buf_at(struct isc_buf_ctrl *b, uint32_t id)
+{
+    return (uint8_t *)b + b->data + (uint64_t)id * b->bsz;
+}
+
+static bool stub_buf_pop(struct isc_buf_ctrl *b, uint32_t *id)
+{
+    uint64_t old = __atomic_load_n(&b->free, __ATOMIC_ACQUIRE), top;
+    uint32_t next;
+
+    do {
+        if (!(uint32_t)old)
+            return false;
+        next = __atomic_load_n(&b->next[(uint32_t)old - 1], __ATOMIC_RELAXED);
+        top = ((old >> 32) + 1) << 32 | next;
+    } while (!__atomic_compare_exchange_n(&b->free, &old, top, true,
+                                          __ATOMIC_ACQUIRE,
+                                          __ATOMIC_ACQUIRE));
+
+    *id = (uint32_t)old - 1;
+    return true;
+}
+
+static void stub_buf_push(struct isc_buf_ctrl *b, uint32_t id)
+{
+    uint64_t old = __atomic_load_n(&b->free, __ATOMIC_RELAXED), top;
+
+    do {
+        __atomic_store_n(&b->next[id], (uint32_t)old, __ATOMIC_RELAXED);
+        top = ((old >> 32) + 1) << 32 | (id + 1);
+    } while (!__atomic_compare_exchange_n(&b->free, &old, top, true,
+                                          __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED));
+}
+
+static inline struct isc_msg *stub_slot(struct stub_queue *q, uint32_t i)
+{
+    return (struct isc_msg *)(q->mem + i * stub_node_size(q));
+}
+
+static inline void stub_signal(struct stub_file *f)
+{
+    uint64_t u = 1;
+    ssize_t rn;
+
+    rn = write(f->fd, &u, sizeof(u));
+    (void)rn;
+}
+
+/*
+ * Each request to a real driver enters the kernel at least once. An eventfd
+ * write and read give the in-process calls the same two syscalls' worth of
+ * cost, so v1 requests are not measured as plain function calls. Each read
+ * takes one count only, so racing callers never wait on each other's write.
+ */
+static inline void stub_crossing(struct stub_file *f)
+{
+    uint64_t u = 1;
+    ssize_t rn;
+
+    rn = write(f->xfd, &u, sizeof(u));
+    rn = read(f->xfd, &u, sizeof(u));
+    (void)rn;
+}
+
+static struct stub_file *stub_get(int fd)
+{
+    if (fd < 0 || fd >= STUB_MAX_FILES)
+        return NULL;
+    return stub_files[fd];
+}
+
+static int stub_open(const char *path, int flags)
+{
+    struct stub_file *f;
+    int fd;
+
+    (void)path;
+    (void)flags;
+
+    fd = eventfd(0, EFD_SEMAPHORE | EFD_NONBLOCK);
+    if (fd < 0)
+        return fd;
+    if (fd >= STUB_MAX_FILES) {
+        close(fd);
+        errno = EMFILE;
+        return -1;
+    }
+
+    f = (struct stub_file *)calloc(1, sizeof(*f));
+    if (!f) {
+        close(fd);
+        return -1;
+    }
+    f->fd = fd;
+    f->xfd = eventfd(0, EFD_SEMAPHORE);
+    if (f->xfd < 0) {
+        free(f);
+        close(fd);
+        return -1;
+    }
+    pthread_mutex_init(&f->lock, NULL);
+    pthread_cond_init(&f->cond, NULL);
+
+    pthread_mutex_lock(&stub_lock);
+    stub_files[fd] = f;
+    pthread_mutex_unlock(&stub_lock);
+    return fd;
+}
+
+static void stub_free_chan(struct stub_file *f, struct stub_chan *c)
+{
+    uint32_t i;
+
+    /* only plain files run a consumer, they are freed without f->lock */
+    if (c->has_consumer) {
+        pthread_mutex_lock(&f->lock);
+        c->stop = true;
+        pthread_cond_broadcast(&f->cond);
+        pthread_mutex_unlock(&f->lock);
+        pthread_join(c->consumer, NULL);
+    }
+
+    if (!f->pool)
+        for (i = 0; i < ARRAY_SIZE(c->q); i++)
+            if (c->q[i].mem)
+                munmap(c->q[i].mem, c->q[i].size);
+    free(c);
+}
+
+static int stub_close(int fd)
+{
+    struct stub_file *f;
+    uint32_t i;
+
+    pthread_mutex_lock(&stub_lock);
+    f = stub_get(fd);
+    if (f)
+        stub_files[fd] = NULL;
+    pthread_mutex_unlock(&stub_lock);
+
+    if (!f)
+        return close(fd);
+
+    for (i = 0; i < ISC_SESSION_MAX; i++)
+        if (f->chans[i])
+            stub_free_chan(f, f->chans[i]);
+    if (f->pool)
+        munmap(f->pool, f->pool_size);
+    if (f->buf)
+        munmap(f->buf, f->buf_size);
+    pthread_cond_destroy(&f->cond);
+    pthread_mutex_destroy(&f->lock);
+    close(f->xfd);
+    free(f);
+    return close(fd);
+}
+
+static struct stub_chan *stub_chan_of(struct stub_file *f, uint32_t uid)
+{
+    uint32_t i;
+
+    for (i = 0; i < ISC_SESSION_MAX; i++)
+        if (f->chans[i] && f->chans[i]->uid == uid)
+            return f->chans[i];
+
+    for (i = 0; i < ISC_SESSION_MAX; i++) {
+        if (f->chans[i])
+            continue;
+        f->chans[i] = (struct stub_chan *)calloc(1, sizeof(struct stub_chan));
+        if (!f->chans[i])
+            return NULL;
+        f->chans[i]->uid = uid;
+        f->chans[i]->idx = i;
+        f->chans[i]->file = f;
+        return f->chans[i];
+    }
+    return NULL;
+}
+
+static void stub_consume(struct stub_chan *c, uint16_t num);
+
+/* as a driver allocating on a node, before the pages are first touched */
+static int stub_place(void *mem, uint64_t size, int node)
+{
+    unsigned long mask[16];
+    unsigned long bits = 8 * sizeof(*mask);
+
+    if (node < 0 || node >= ARRAY_SIZE(mask) * bits)
+        return -1;
+
+    memset(mask, 0, sizeof(mask));
+    mask[node / bits] = 1ul << (node % bits);
+    if (syscall(SYS_mbind, mem, size, MPOL_BIND, mask, node + 2, 0) < 0)
+        return -1;
+    return 0;
+}
+
+static void *stub_consumer(void *arg)
+{
+    struct stub_chan *c = (struct stub_chan *)arg;
+    struct stub_file *f = c->file;
+    struct stub_queue *q = &c->q[ISC_BIND_U_2_K];
+    struct isc_ring *r = q->ring;
+    uint32_t tail = 0, i;
+
+    while (!__atomic_load_n(&c->stop, __ATOMIC_RELAXED)) {
+        if (q->keep && __atomic_load_n(&c->unbound, __ATOMIC_RELAXED)) {
+            /* what is queued waits for the peer to come back */
+            pthread_mutex_lock(&f->lock);
+            while (!c->stop && c->unbound)
+                pthread_cond_wait(&f->cond, &f->lock);
+            pthread_mutex_unlock(&f->lock);
+            continue;
+        }
+
+        if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) != tail) {
+            stub_consume(c, 1);
+            __atomic_store_n(&r->tail, ++tail, __ATOMIC_RELEASE);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&r->prod_wait, __ATOMIC_RELAXED)) {
+                pthread_mutex_lock(&f->lock);
+                pthread_cond_broadcast(&f->cond);
+                pthread_mutex_unlock(&f->lock);
+            }
+            continue;
+        }
+
+        for (i = 0; i < STUB_RING_SPIN; i++) {
+            if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) != tail)
+                break;
+            sched_yield();
+        }
+        if (i < STUB_RING_SPIN)
+            continue;
+
+        /* a producer seeing cons_wait kicks under f->lock, never lost */
+        pthread_mutex_lock(&f->lock);
+        __atomic_store_n(&r->cons_wait, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        while (!c->stop && __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == tail)
+            pthread_cond_wait(&f->cond, &f->lock);
+        __atomic_store_n(&r->cons_wait, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&f->lock);
+    }
+    return NULL;
+}
+
+static int stub_alloc_queue(struct stub_file *f, struct stub_chan *c,
+                            struct isc_bind2 *b)
+{
+    struct stub_queue *q = &c->q[b->dir];
+    uint32_t size, ring = 0;
+
+    /* only the user side consumes a ring it can ask to be kicked late */
+    if (b->ver >= ISC_PROTO_V2 && b->dir == ISC_BIND_K_2_U)
+        b->feat &= ISC_FEAT_TS | ISC_FEAT_WANT | ISC_FEAT_KEEP | ISC_FEAT_NODE;
+    else
+        b->feat &= ISC_FEAT_TS | ISC_FEAT_KEEP | ISC_FEAT_NODE;
+    q->ts = b->feat & ISC_FEAT_TS;
+    q->want = b->feat & ISC_FEAT_WANT;
+    q->keep = b->feat & ISC_FEAT_KEEP;
+    size = stub_slot_size(b->msz, q->ts) * b->num;
+    if (b->ver >= ISC_PROTO_V2) {
+        /* the ring indices follow the slots in the same mapping */
+        ring = STUB_ALIGN(size, 64);
+        size = ring + sizeof(struct isc_ring);
+    }
+    size = STUB_ALIGN(size, STUB_PAGE_SIZE);
+    q->mem = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (q->mem == MAP_FAILED) {
+        q->mem = NULL;
+        return -ENOMEM;
+    }
+    if ((b->feat & ISC_FEAT_NODE) && stub_place(q->mem, size, b->node) < 0)
+        b->feat &= ~ISC_FEAT_NODE;
+
+    q->size = size;
+    q->msz = b->msz;
+    q->num = b->num;
+    if (ring)
+        q->ring = (struct isc_ring *)(q->mem + ring);
+
+    if (q->ring && b->dir == ISC_BIND_U_2_K) {
+        if (pthread_create(&c->consumer, NULL, stub_consumer, c)) {
+            munmap(q->mem, q->size);
+            memset(q, 0, sizeof(*q));
+            return -ENOMEM;
+        }
+        c->has_consumer = true;
+    }
+
+    b->ver = ring ? ISC_PROTO_V2 : ISC_PROTO_V1;
+    b->ring = ring;
+    b->size = size;
+    b->mem = (uint64_t)b->dir * STUB_PAGE_SIZE;
+    b->stat = 1;
+    return 0;
+}
+
+static int stub_bind(struct stub_file *f, struct isc_bind2 *b)
+{
+    struct stub_chan *c;
+
+    if (b->dir > ISC_BIND_K_2_U || !b->num || f->pool)
+        return -EINVAL;
+
+    if (f->chans[0] && f->chans[0]->uid != b->uid)
+        return -EBUSY;
+
+    c = stub_chan_of(f, b->uid);
+    if (!c)
+        return -ENOMEM;
+
+    if (c->q[b->dir].mem)
+        return -EBUSY;
+
+    return stub_alloc_queue(f, c, b);
+}
+
+/* f->lock held, dropped while the consumer exits */
+static void stub_stop_consumer(struct stub_file *f, struct stub_chan *c)
+{
+    c->stop = true;
+    pthread_cond_broadcast(&f->cond);
+    pthread_mutex_unlock(&f->lock);
+    pthread_join(c->consumer, NULL);
+    pthread_mutex_lock(&f->lock);
+    c->stop = false;
+    c->has_consumer = false;
+}
+
+/* unconsumed kernel-to-user messages move to the front of the new queue */
+static int stub_resize(struct stub_file *f, struct isc_bind2 *b)
+{
+    struct stub_chan *c = f->chans[0];
+    struct stub_queue *q, old;
+    uint32_t n, i, from;
+    int rc;
+
+    if (f->pool || !c || b->dir > ISC_BIND_K_2_U || !b->num ||
+        !c->q[b->dir].ring || c->q[b->dir].msz != b->msz ||
+        c->q[b->dir].ts != !!(b->feat & ISC_FEAT_TS) || b->ver < ISC_PROTO_V2)
+        return -EINVAL;
+
+    q = &c->q[b->dir];
+    if (b->dir == ISC_BIND_U_2_K) {
+        /* the sender keeps the sendq quiescent while it resizes */
+        if (q->ring->head != q->ring->tail)
+            return -EBUSY;
+        stub_stop_consumer(f, c);
+    }
+
+    n = __atomic_load_n(&q->ring->head, __ATOMIC_ACQUIRE) -
+        __atomic_load_n(&q->ring->tail, __ATOMIC_ACQUIRE);
+    if (n > b->num)
+        return -EBUSY;
+
+    old = *q;
+    memset(q, 0, sizeof(*q));
+    q->waiters = old.waiters;
+    rc = stub_alloc_queue(f, c, b);
+    if (rc < 0) {
+        *q = old;
+        if (b->dir == ISC_BIND_U_2_K &&
+            !pthread_create(&c->consumer, NULL, stub_consumer, c))
+            c->has_consumer = true;
+        return rc;
+    }
+
+    from = (old.wp + old.num - n) % old.num;
+    for (i = 0; i < n; i++)
+        memcpy(stub_slot(q, i), stub_slot(&old, (from + i) % old.num),
+               stub_node_size(q));
+    q->wp = n % q->num;
+    __atomic_store_n(&q->ring->head, n, __ATOMIC_RELEASE);
+
+    munmap(old.mem, old.size);
+    /* posters blocked on the old ring now see the new one */
+    pthread_cond_broadcast(&f->cond);
+    return 0;
+}
+
+static int stub_bind_v1(struct stub_file *f, struct isc_bind *b1)
+{
+    struct isc_bind2 b;
+    int rc;
+
+    memset(&b, 0, sizeof(b));
+    b.uid = b1->uid;
+    b.msz = b1->msz;
+    b.num = b1->num;
+    b.dir = b1->dir;
+    rc = stub_bind(f, &b);
+    if (rc < 0)
+        return rc;
+
+    b1->stat = b.stat;
+    b1->size = b.size;
+    b1->mem = b.mem;
+    return 0;
+}
+
+static int stub_kick(struct stub_file *f, struct isc_kick *k)
+{
+    struct stub_chan *c = f->chans[0];
+    struct isc_ring *r;
+    uint64_t u;
+
+    if (f->pool || !c || k->dir > ISC_BIND_K_2_U || !c->q[k->dir].ring)
+        return -ENOTCONN;
+
+    r = c->q[k->dir].ring;
+    switch (k->op) {
+    case ISC_KICK_WAKE:
+        pthread_cond_broadcast(&f->cond);
+        return 0;
+    case ISC_KICK_WAIT:
+        if (k->dir != ISC_BIND_U_2_K)
+            return -EINVAL;
+        while (!f->closed &&
+               (int32_t)(__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) -
+                         k->idx) < 0)
+            pthread_cond_wait(&f->cond, &f->lock);
+        return f->closed ? -ENOTCONN : 0;
+    case ISC_KICK_ARM:
+        while (read(f->fd, &u, sizeof(u)) == sizeof(u))
+            ;
+        return 0;
+    }
+    return -EINVAL;
+}
+
+static int stub_pool(struct stub_file *f, struct isc_pool *p)
+{
+    uint32_t size;
+
+    if (f->pool || f->chans[0] || !p->size)
+        return -EINVAL;
+
+    size = STUB_ALIGN(sizeof(struct isc_pool_ctrl), STUB_PAGE_SIZE) + p->size;
+    size = STUB_ALIGN(size, STUB_PAGE_SIZE);
+    f->pool = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (f->pool == MAP_FAILED) {
+        f->pool = NULL;
+        return -ENOMEM;
+    }
+    if (p->node >= 0 && stub_place(f->pool, size, p->node) < 0)
+        p->node = -1;
+
+    f->pool_size = size;
+    f->pool_used = STUB_ALIGN(sizeof(struct isc_pool_ctrl), STUB_PAGE_SIZE);
+    f->ctrl = (struct isc_pool_ctrl *)f->pool;
+
+    p->size = size;
+    p->mem = 0;
+    return 0;
+}
+
+static int stub_buf_pool(struct stub_file *f, struct isc_buf_pool *bp)
+{
+    struct isc_buf_ctrl *b;
+    uint64_t data, size;
+    uint32_t i;
+
+    if (f->pool || f->buf || !bp->bsz || !bp->num)
+        return -EINVAL;
+
+    bp->bsz = STUB_ALIGN(bp->bsz, 64);
+    data = STUB_ALIGN(sizeof(*b) + (uint64_t)bp->num * sizeof(b->next[0]),
+                      STUB_PAGE_SIZE);
+    size = STUB_ALIGN(data + (uint64_t)bp->num * bp->bsz, STUB_PAGE_SIZE);
+    b = (struct isc_buf_ctrl *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (b == MAP_FAILED)
+        return -ENOMEM;
+    if (bp->node >= 0 && stub_place(b, size, bp->node) < 0)
+        bp->node = -1;
+
+    b->bsz = bp->bsz;
+    b->num = bp->num;
+    b->data = data;
+    for (i = 0; i + 1 < b->num; i++)
+        b->next[i] = i + 2;
+    b->free = 1;
+
+    f->buf = b;
+    f->buf_size = size;
+    bp->size = size;
+    bp->mem = STUB_BUF_OFF;
+    return 0;
+}
+
+static int stub_chan_bind(struct stub_file *f, struct isc_chan_bind *cb)
+{
+    struct isc_bind2 *b = &cb->b;
+    struct stub_chan *c;
+    struct stub_queue *q;
+    uint32_t size;
+
+    if (b->dir > ISC_BIND_K_2_U || !b->num || !f->pool)
+        return -EINVAL;
+
+    b->feat &= ISC_FEAT_TS;
+    size = stub_slot_size(b->msz, b->feat & ISC_FEAT_TS) * b->num;
+    size = STUB_ALIGN(size, 64);
+    if (f->pool_used + size > f->pool_size)
+        return -ENOSPC;
+
+    c = stub_chan_of(f, b->uid);
+    if (!c)
+        return -ENOSPC;
+
+    q = &c->q[b->dir];
+    if (q->mem)
+        return -EBUSY;
+
+    q->mem = f->pool + f->pool_used;
+    q->size = size;
+    q->msz = b->msz;
+    q->num = b->num;
+    q->ts = b->feat & ISC_FEAT_TS;
+    f->pool_used += size;
+
+    __atomic_store_n(&f->ctrl->stat[c->idx], 1, __ATOMIC_RELEASE);
+
+    b->size = size;
+    b->mem = q->mem - f->pool;
+    b->stat = 1;
+    cb->ch = c->idx;
+    return 0;
+}
+
+static void stub_consume(struct stub_chan *c, uint16_t num)
+{
+    struct stub_queue *q = &c->q[ISC_BIND_U_2_K];
+    struct isc_buf_ctrl *b = c->file->buf;
+    struct isc_buf_desc *desc;
+    struct isc_msg_ts *ts;
+    struct isc_msg *m;
+    uint32_t len;
+    uint16_t i;
+    void *data;
+
+    for (i = 0; i < num; i++) {
+        m = stub_slot(q, q->rp);
+        ts = q->ts ? stub_msg_ts(m) : NULL;
+        if (ts)
+            ts->pickup = stub_now();
+        data = stub_msg_data(m);
+        len = m->len;
+        desc = NULL;
+        if ((m->flags & ISC_MSG_FLAG_BUF) && len >= sizeof(*desc)) {
+            desc = (struct isc_buf_desc *)data;
+            if (b && desc->id < b->num && desc->off <= b->bsz &&
+                desc->len <= b->bsz - desc->off) {
+                data = (uint8_t *)stub_buf_at(b, desc->id) + desc->off;
+                len = desc->len;
+            } else {
+                data = NULL;
+            }
+        }
+        if (m->len > q->msz || !data)
+            m->rc = -1;
+        else if (stub_handler)
+            m->rc = stub_handler(c->uid, data, len, stub_handler_arg);
+        else
+            m->rc = 0;
+        /* a one-way buffer is the driver's to free */
+        if (data && desc && (m->flags & ISC_MSG_FLAG_ONEWAY))
+            stub_buf_push(b, desc->id);
+        if (ts)
+            ts->done = stub_now();
+        q->rp = (q->rp + 1) % q->num;
+    }
+}
+
+/* an ack names the first message of the batch by its seq */
+static int stub_release(struct stub_file *f, struct stub_chan *c, uint16_t seq,
+                        uint16_t num)
+{
+    struct stub_queue *q = &c->q[ISC_BIND_K_2_U];
+    uint64_t u;
+    uint16_t i;
+
+    if (num && q->cnt && stub_slot(q, q->rp)->seq != seq)
+        return -EINVAL;
+
+    for (i = 0; i < num && q->cnt; i++) {
+        if (read(f->fd, &u, sizeof(u)) != sizeof(u))
+            break;
+        q->rp = (q->rp + 1) % q->num;
+        q->cnt--;
+    }
+    pthread_cond_broadcast(&f->cond);
+    return 0;
+}
+
+static int stub_send(struct stub_file *f, struct isc_send *s)
+{
+    struct stub_chan *c = f->chans[0];
+
+    if (f->pool || !c || !c->q[ISC_BIND_U_2_K].mem)
+        return -ENOTCONN;
+
+    stub_consume(c, s->num);
+    return 0;
+}
+
+static int stub_recv(struct stub_file *f, struct isc_recv *r)
+{
+    struct stub_chan *c = f->chans[0];
+
+    if (f->pool || !c || !c->q[ISC_BIND_K_2_U].mem)
+        return -ENOTCONN;
+
+    return stub_release(f, c, r->seq, r->num);
+}
+
+static int stub_chan_xfer(struct stub_file *f, unsigned long req,
+                          struct isc_chan_xfer *x)
+{
+    struct stub_chan *c;
+    uint64_t u;
+    ssize_t rn;
+
+    if (!f->pool || x->ch >= ISC_SESSION_MAX || !f->chans[x->ch])
+        return -ENOTCONN;
+
+    c = f->chans[x->ch];
+    switch (req) {
+    case ISC_IOCTL_CH_SEND:
+        if (!c->q[ISC_BIND_U_2_K].mem)
+            return -ENOTCONN;
+        stub_consume(c, x->num);
+        break;
+    case ISC_IOCTL_CH_RECV:
+        if (x->num)
+            return stub_release(f, c, x->seq, x->num);
+        rn = read(f->fd, &u, sizeof(u));
+        (void)rn;
+        break;
+    case ISC_IOCTL_CH_CLOSE:
+        __atomic_store_n(&f->ctrl->stat[c->idx], 0, __ATOMIC_RELEASE);
+        f->chans[x->ch] = NULL;
+        stub_free_chan(f, c);
+        pthread_cond_broadcast(&f->cond);
+        break;
+    }
+    return 0;
+}
+
+static int stub_ioctl(int fd, unsigned long req, void *arg)
+{
+    struct stub_file *f = stub_get(fd);
+    int rc;
+
+    if (!f || !arg) {
+        errno = EBADF;
+        return -1;
+    }
+
+    /* what a driver predating them answers to requests it does not know */
+    if (stub_legacy && req != ISC_IOCTL_BIND && req != ISC_IOCTL_SEND &&
+        req != ISC_IOCTL_RECV && req != ISC_IOCTL_CLOSE) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    stub_crossing(f);
+    pthread_mutex_lock(&f->lock);
+    switch (req) {
+    case ISC_IOCTL_BIND:
+        rc = stub_bind_v1(f, (struct isc_bind *)arg);
+        break;
+    case ISC_IOCTL_BIND2:
+        rc = stub_bind(f, (struct isc_bind2 *)arg);
+        break;
+    case ISC_IOCTL_RESIZE:
+        rc = stub_resize(f, (struct isc_bind2 *)arg);
+        break;
+    case ISC_IOCTL_SEND:
+        rc = stub_send(f, (struct isc_send *)arg);
+        break;
+    case ISC_IOCTL_RECV:
+        rc = stub_recv(f, (struct isc_recv *)arg);
+        break;
+    case ISC_IOCTL_CLOSE:
+        f->closed = true;
+        pthread_cond_broadcast(&f->cond);
+        rc = 0;
+        break;
+    case ISC_IOCTL_POOL:
+        rc = stub_pool(f, (struct isc_pool *)arg);
+        break;
+    case ISC_IOCTL_CH_BIND:
+        rc = stub_chan_bind(f, (struct isc_chan_bind *)arg);
+        break;
+    case ISC_IOCTL_CH_SEND:
+    case ISC_IOCTL_CH_RECV:
+    case ISC_IOCTL_CH_CLOSE:
+        rc = stub_chan_xfer(f, req, (struct isc_chan_xfer *)arg);
+        break;
+    case ISC_IOCTL_KICK:
+        rc = stub_kick(f, (struct isc_kick *)arg);
+        break;
+    case ISC_IOCTL_BUF_POOL:
+        rc = stub_buf_pool(f, (struct isc_buf_pool *)arg);
+        break;
+    default:
+        rc = -ENOTTY;
+        break;
+    }
+    pthread_mutex_unlock(&f->lock);
+
+    if (rc < 0) {
+        errno = -rc;
+        return -1;
+    }
+    return 0;
+}
+
+static void *stub_mmap(void *addr, size_t len, int prot, int flags, int fd,
+                       off_t off)
+{
+    struct stub_file *f = stub_get(fd);
+    struct stub_queue *q;
+
+    (void)addr;
+    (void)prot;
+    (void)flags;
+
+    if (!f)
+        return MAP_FAILED;
+
+    if (f->pool)
+        return off || len > f->pool_size ? MAP_FAILED : f->pool;
+
+    if (off == STUB_BUF_OFF)
+        return !f->buf || len > f->buf_size ? MAP_FAILED : f->buf;
+
+    if (!f->chans[0] || off % STUB_PAGE_SIZE ||
+        off / STUB_PAGE_SIZE >= ARRAY_SIZE(f->chans[0]->q))
+        return MAP_FAILED;
+
+    q = &f->chans[0]->q[off / STUB_PAGE_SIZE];
+    if (!q->mem || len > q->size)
+        return MAP_FAILED;
+    return q->mem;
+}
+
+static int stub_munmap(void *addr, size_t len)
+{
+    /* queue memory belongs to the file and goes away with it */
+    (void)addr;
+    (void)len;
+    return 0;
+}
+
+static const struct isc_dev_ops stub_ops = {
+    .open = stub_open,
+    .close = stub_close,
+    .ioctl = stub_ioctl,
+    .mmap = stub_mmap,
+    .munmap = stub_munmap,
+};
+
+void isc_stub_install(void)
+{
+    isc_set_dev_ops(&stub_ops);
+}
+
+void isc_stub_set_legacy(bool legacy)
+{
+    stub_legacy = legacy;
+}
+
+void isc_stub_set_handler(isc_stub_handler handler, void *arg)
+{
+    stub_handler = handler;
+    stub_handler_arg = arg;
+}
+
+/* the file is returned locked, the caller must not race with close */
+static struct stub_file *stub_find(uint32_t uid, bool need_recvq,
+                                   struct stub_chan **chan)
+{
+    struct stub_file *f;
+    struct stub_chan *c;
+    uint32_t i, j;
+
+    pthread_mutex_lock(&stub_lock);
+    for (i = 0; i < STUB_MAX_FILES; i++) {
+        f = stub_files[i];
+        if (!f)
+            continue;
+        pthread_mutex_lock(&f->lock);
+        for (j = 0; j < ISC_SESSION_MAX; j++) {
+            c = f->chans[j];
+            if (c && c->uid == uid &&
+                (!need_recvq || c->q[ISC_BIND_K_2_U].mem)) {
+                pthread_mutex_unlock(&stub_lock);
+                *chan = c;
+                return f;
+            }
+        }
+        pthread_mutex_unlock(&f->lock);
+    }
+    pthread_mutex_unlock(&stub_lock);
+    return NULL;
+}
+
+static void stub_publish(struct stub_file *f, struct stub_chan *c)
+{
+    uint64_t bit = 1ull << (c->idx % 64);
+
+    /* the fd counts one per message, it must be ahead of posted */
+    stub_signal(f);
+    if (!f->pool)
+        return;
+    __atomic_store_n(&f->ctrl->posted[c->idx], ++c->posted,
+                     __ATOMIC_RELEASE);
+    __atomic_or_fetch(&f->ctrl->ready[c->idx / 64], bit, __ATOMIC_RELEASE);
+}
+
+/* write the next kernel-to-user slot at q->wp */
+static void stub_fill(struct stub_chan *c, struct stub_queue *q,
+                      uint32_t flags, const void *msg, uint32_t len)
+{
+    struct isc_msg *m = stub_slot(q, q->wp);
+    struct isc_msg_ts *ts;
+
+    m->flags = flags | (q->ts ? ISC_MSG_FLAG_TS : 0);
+    m->seq = c->seq++;
+    m->len = len;
+    m->rc = 0;
+    ts = stub_msg_ts(m);
+    if (ts) {
+        ts->pickup = 0;
+        ts->done = 0;
+        ts->enq = stub_now();
+    }
+    memcpy(stub_msg_data(m), msg, len);
+    q->wp = (q->wp + 1) % q->num;
+}
+
+static int stub_ring_put(struct stub_file *f, struct stub_chan *c,
+                         uint32_t flags, const void *msg, uint32_t len)
+{
+    struct stub_queue *q = &c->q[ISC_BIND_K_2_U];
+    uint32_t head, want;
+    struct isc_ring *r;
+
+    /* the ring may be replaced by a resize while waiting */
+    q->waiters++;
+    for (;;) {
+        r = q->ring;
+        head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+        if (f->closed || f->chans[0] != c ||
+            head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) < q->num)
+            break;
+        __atomic_store_n(&r->prod_wait, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) < q->num)
+            break;
+        pthread_cond_wait(&f->cond, &f->lock);
+    }
+    if (!--q->waiters)
+        __atomic_store_n(&r->prod_wait, 0, __ATOMIC_RELAXED);
+    if (f->closed || f->chans[0] != c)
+        return -1;
+
+    stub_fill(c, q, flags, msg, len);
+
+    __atomic_store_n(&r->head, ++head, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&r->cons_wait, __ATOMIC_ACQUIRE))
+        return 0;
+    want = q->want ? __atomic_load_n(&r->cons_want, __ATOMIC_RELAXED) : 0;
+    if (!want || (int32_t)(head - want) >= 0)
+        stub_signal(f);
+    return 0;
+}
+
+static int stub_put(struct stub_file *f, struct stub_chan *c, uint32_t flags,
+                    const void *msg, uint32_t len)
+{
+    struct stub_queue *q = &c->q[ISC_BIND_K_2_U];
+    uint32_t idx = c->idx;
+
+    if (len > q->msz)
+        return -1;
+
+    if (q->ring)
+        return stub_ring_put(f, c, flags, msg, len);
+
+    while (!f->closed && f->chans[idx] == c && q->cnt == q->num)
+        pthread_cond_wait(&f->cond, &f->lock);
+    if (f->closed || f->chans[idx] != c)
+        return -1;
+
+    stub_fill(c, q, flags, msg, len);
+    q->cnt++;
+
+    stub_publish(f, c);
+    return 0;
+}
+
+int isc_stub_post(uint32_t uid, const void *msg, uint32_t len)
+{
+    struct stub_chan *c;
+    struct stub_file *f;
+    int rc;
+
+    if (!msg)
+        return -1;
+
+    f = stub_find(uid, true, &c);
+    if (!f)
+        return -1;
+
+    rc = stub_put(f, c, ISC_MSG_FLAG_USER, msg, len);
+    pthread_mutex_unlock(&f->lock);
+    return rc;
+}
+
+int isc_stub_post_buf(uint32_t uid, const void *msg, uint32_t len)
+{
+    struct isc_buf_desc desc;
+    struct stub_chan *c;
+    struct stub_file *f;
+    int rc = -1;
+
+    if (!msg)
+        return -1;
+
+    f = stub_find(uid, true, &c);
+    if (!f)
+        return -1;
+
+    if (!f->buf || len > f->buf->bsz)
+        goto _exit;
+
+    /* the library frees a buffer once its listeners returned */
+    while (!stub_buf_pop(f->buf, &desc.id)) {
+        if (f->closed || f->chans[0] != c)
+            goto _exit;
+        pthread_mutex_unlock(&f->lock);
+        sched_yield();
+        pthread_mutex_lock(&f->lock);
+    }
+
+    memcpy(stub_buf_at(f->buf, desc.id), msg, len);
+    desc.off = 0;
+    desc.len = len;
+    desc.rsvd = 0;
+    rc = stub_put(f, c, ISC_MSG_FLAG_USER | ISC_MSG_FLAG_BUF, &desc,
+                  sizeof(desc));
+    if (rc < 0)
+        stub_buf_push(f->buf, desc.id);
+
+_exit:
+    pthread_mutex_unlock(&f->lock);
+    return rc;
+}
+
+int isc_stub_set_link(uint32_t uid, bool is_bound)
+{
+    struct isc_int_msg imsg;
+    struct stub_chan *c;
+    struct stub_file *f;
+    uint64_t bit, old;
+    int rc = 0;
+
+    f = stub_find(uid, false, &c);
+    if (!f)
+        return -1;
+
+    if (f->pool) {
+        bit = 1ull << (c->idx % 64);
+        __atomic_store_n(&f->ctrl->stat[c->idx], is_bound ? 1 : 0,
+                         __ATOMIC_RELEASE);
+        old = __atomic_load_n(&f->ctrl->event[c->idx / 64], __ATOMIC_ACQUIRE);
+        /* one fd count per pending event bit */
+        if (!(old & bit)) {
+            stub_signal(f);
+            __atomic_or_fetch(&f->ctrl->event[c->idx / 64], bit,
+                              __ATOMIC_RELEASE);
+        }
+    } else if (c->q[ISC_BIND_K_2_U].mem) {
+        __atomic_store_n(&c->unbound, !is_bound, __ATOMIC_RELAXED);
+        pthread_cond_broadcast(&f->cond);
+        imsg.id = is_bound ? ISC_MSG_BOUND : ISC_MSG_UNBIND;
+        imsg.len = 0;
+        rc = stub_put(f, c, 0, &imsg, sizeof(imsg));
+    }
+
+    pthread_mutex_unlock(&f->lock);
+    return rc;
+}
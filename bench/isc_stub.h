@@ -0,0 +1,43 @@
+/* See LICENSE for license details */
+#ifndef _ISC_STUB_H_
+#define _ISC_STUB_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Userspace stand-in for /dev/isc. It implements the driver side of
+ * isc_uapi.h on top of an eventfd per open file, so the library and
+ * the tools built on it can run on machines without the ISC driver.
+ */
+
+/* called for every user-to-kernel message, may rewrite msg as the reply */
+typedef int32_t (*isc_stub_handler)(uint32_t uid, void *msg, uint32_t len,
+                                    void *arg);
+
+/* route all ISC library device ops to the stand-in */
+void isc_stub_install(void);
+
+/* answer only the requests of the first driver release, others get EINVAL */
+void isc_stub_set_legacy(bool legacy);
+
+void isc_stub_set_handler(isc_stub_handler handler, void *arg);
+
+/* kernel-to-user message, blocks while the receive queue of uid is full */
+int isc_stub_post(uint32_t uid, const void *msg, uint32_t len);
+
+/* same through a buffer of the ISC_OPT_BUF pool of uid, waits for a free one */
+int isc_stub_post_buf(uint32_t uid, const void *msg, uint32_t len);
+
+/* peer of uid goes away or comes back, as on a driver reload */
+int isc_stub_set_link(uint32_t uid, bool is_bound);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _ISC_STUB_H_ */
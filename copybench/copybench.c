@@ -0,0 +1,268 @@
+// See LICENSE for license details.
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "isc_copy.h"
+
+#define LOGE(...) fprintf(stderr, __VA_ARGS__)
+
+#define COPY_MAX_SIZES 32
+
+struct copy_point {
+    uint64_t copies;
+    double copy_ns, ws_ns; /* per copy */
+};
+
+static uint64_t sizes[COPY_MAX_SIZES] = {
+    1 << 10, 4 << 10, 16 << 10, 64 << 10, 256 << 10, 1 << 20, 4 << 20,
+};
+static uint32_t nsizes = 7;
+static uint32_t slots = 64;
+static uint32_t offset = 8;
+static uint64_t ws_size = 1 << 20;
+static uint64_t budget = 256ull << 20;
+
+static struct copy_point points[COPY_MAX_SIZES][ISC_COPY_KINDS];
+
+static inline uint64_t copy_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* 4096, 64K, 1M or 1G */
+static int copy_parse_size(const char *s, char **end, uint64_t *v)
+{
+    *v = strtoull(s, end, 0);
+    switch (**end) {
+    case 'G':
+    case 'g':
+        *v <<= 10;
+        /* fall through */
+    case 'M':
+    case 'm':
+        *v <<= 10;
+        /* fall through */
+    case 'K':
+    case 'k':
+        *v <<= 10;
+        (*end)++;
+        break;
+    default:
+        break;
+    }
+    return *end == s ? -1 : 0;
+}
+
+static int copy_parse_list(const char *s)
+{
+    char *end;
+
+    for (nsizes = 0; nsizes < COPY_MAX_SIZES; s = end + 1) {
+        if (copy_parse_size(s, &end, &sizes[nsizes]) < 0 || !sizes[nsizes])
+            return -1;
+        nsizes++;
+        if (*end != ',')
+            break;
+    }
+    return *end ? -1 : 0;
+}
+
+/*
+ * Copy into a ring of slots as a sender fills the queue, then walk a working
+ * set standing for the sender's own hot data. Streaming stores show up as a
+ * slower copy where the slots would have fit in the cache, and as a faster
+ * walk where plain stores evict the working set.
+ */
+static void copy_run(struct copy_point *p, isc_copy_fn fn, uint8_t *ring,
+                     uint64_t stride, const uint8_t *src, uint64_t size,
+                     const uint64_t *ws)
+{
+    uint64_t n = budget / size, i, j, t0, t1, t2;
+    volatile uint64_t sink = 0;
+    uint64_t sum;
+
+    if (n < 4 * slots)
+        n = 4 * slots;
+
+    /* one pass to fault in and settle the ring */
+    for (i = 0; i < slots; i++)
+        fn(ring + i * stride + offset, src, size);
+
+    p->copies = n;
+    p->copy_ns = 0;
+    p->ws_ns = 0;
+    for (i = 0; i < n; i++) {
+        t0 = copy_now();
+        fn(ring + (i % slots) * stride + offset, src, size);
+        t1 = copy_now();
+        sum = 0;
+        for (j = 0; j < ws_size / sizeof(*ws); j += 8)
+            sum += ws[j];
+        sink += sum;
+        t2 = copy_now();
+        p->copy_ns += t1 - t0;
+        p->ws_ns += t2 - t1;
+    }
+    p->copy_ns /= n;
+    p->ws_ns /= n;
+    (void)sink;
+}
+
+static void copy_report(uint64_t size, enum isc_copy_kind kind,
+                        const struct copy_point *p)
+{
+    printf("{\"size\":%llu,\"kernel\":\"%s\",\"slots\":%u,\"offset\":%u,"
+           "\"ws\":%llu,\"copies\":%llu,\"copy_ns\":%.0f,"
+           "\"gbytes_per_sec\":%.2f,\"ws_ns\":%.0f,\"total_ns\":%.0f}\n",
+           (unsigned long long)size, isc_copy_name(kind), slots, offset,
+           (unsigned long long)ws_size, (unsigned long long)p->copies,
+           p->copy_ns, p->copy_ns > 0 ? size / p->copy_ns : 0, p->ws_ns,
+           p->copy_ns + p->ws_ns);
+    fflush(stdout);
+}
+
+/* the smallest size from which on the kernel never loses to memcpy() */
+static uint64_t copy_crossover(enum isc_copy_kind kind)
+{
+    const struct copy_point *nt, *libc;
+    uint64_t at = 0;
+    uint32_t i;
+
+    for (i = 0; i < nsizes; i++) {
+        nt = &points[i][kind];
+        libc = &points[i][ISC_COPY_LIBC];
+        if (nt->copy_ns + nt->ws_ns <= libc->copy_ns + libc->ws_ns) {
+            if (!at)
+                at = sizes[i];
+        } else {
+            at = 0;
+        }
+    }
+    return at;
+}
+
+static int copy_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void copy_usage(const char *name)
+{
+    LOGE("usage: %s [-m sizes] [-n slots] [-o offset] [-w bytes] "
+         "[-b bytes]\n"
+         "  -m  comma separated payload sizes, K/M suffixes allowed\n"
+         "      (default 1K,4K,16K,64K,256K,1M,4M)\n"
+         "  -n  queue slots copied into round robin (default 64)\n"
+         "  -o  offset of the payload in its slot (default 8)\n"
+         "  -w  working set walked after each copy, 0 for none\n"
+         "      (default 1M)\n"
+         "  -b  bytes copied per size and kernel (default 256M)\n"
+         "Each size and kernel is printed as one JSON object, followed by\n"
+         "the crossover of each streaming kernel against memcpy(), 0 if\n"
+         "it never wins.\n",
+         name);
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t max, stride, at, v;
+    enum isc_copy_kind kind, best;
+    isc_copy_fn fn;
+    uint8_t *ring, *src;
+    uint64_t *ws = NULL;
+    const char *sep = "";
+    char *end;
+    uint32_t i;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:n:o:w:b:h")) != -1) {
+        switch (opt) {
+        case 'm':
+            if (copy_parse_list(optarg) < 0)
+                goto _usage;
+            break;
+        case 'n':
+            slots = strtoul(optarg, NULL, 0);
+            if (!slots)
+                goto _usage;
+            break;
+        case 'o':
+            offset = strtoul(optarg, NULL, 0);
+            break;
+        case 'w':
+            if (copy_parse_size(optarg, &end, &ws_size) < 0 || *end)
+                goto _usage;
+            break;
+        case 'b':
+            if (copy_parse_size(optarg, &end, &v) < 0 || *end || !v)
+                goto _usage;
+            budget = v;
+            break;
+        default:
+            goto _usage;
+        }
+    }
+    if (optind != argc)
+        goto _usage;
+
+    qsort(sizes, nsizes, sizeof(*sizes), copy_cmp);
+    max = sizes[nsizes - 1];
+    stride = (max + offset + 4095) & ~4095ull;
+
+    /* anonymous shared memory stands in for the queue mapping */
+    ring = (uint8_t *)mmap(NULL, stride * slots, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    src = (uint8_t *)malloc(max);
+    if (ws_size)
+        ws = (uint64_t *)malloc(ws_size);
+    if (ring == MAP_FAILED || !src || (ws_size && !ws)) {
+        LOGE("failed to allocate %llu bytes of slots\n",
+             (unsigned long long)(stride * slots));
+        return -1;
+    }
+    memset(src, 0x5a, max);
+    if (ws)
+        memset(ws, 0xa5, ws_size);
+
+    for (i = 0; i < nsizes; i++) {
+        for (kind = ISC_COPY_LIBC; kind < ISC_COPY_KINDS; kind++) {
+            fn = isc_copy_kernel(kind);
+            if (!fn)
+                continue;
+            copy_run(&points[i][kind], fn, ring, stride, src, sizes[i], ws);
+            copy_report(sizes[i], kind, &points[i][kind]);
+        }
+    }
+
+    best = isc_copy_best();
+    printf("{\"best\":\"%s\",\"nt_min\":%u,\"crossover\":{",
+           isc_copy_name(best), isc_copy_nt_min());
+    for (kind = ISC_COPY_LIBC + 1; kind < ISC_COPY_KINDS; kind++) {
+        if (!isc_copy_kernel(kind))
+            continue;
+        at = copy_crossover(kind);
+        printf("%s\"%s\":%llu", sep, isc_copy_name(kind),
+               (unsigned long long)at);
+        sep = ",";
+    }
+    printf("}}\n");
+
+    munmap(ring, stride * slots);
+    free(src);
+    free(ws);
+    return 0;
+
+_usage:
+    copy_usage(argv[0]);
+    return -1;
+}
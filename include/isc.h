@@ -2,6 +2,9 @@
 #ifndef _ISC_H_
 #define _ISC_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -12,6 +15,42 @@ struct isc_listener_ops {
     void (*bound)(void *arg);
     void (*unbind)(void *arg);
     int32_t (*got)(void *msg, uint32_t len, void *arg);
+    /*
+     * A one-way message failed. Called on the thread whose send(),
+     * send_oneway() or oneway_errors() found the failure, once the handle's
+     * send lock is dropped, with its listener lock held. msg is a copy
+     * valid for the call only.
+     */
+    void (*oneway_failed)(const void *msg, uint32_t len, int32_t rc,
+                          void *arg);
+};
+
+struct isc_queue_stat {
+    uint16_t num;      /* current depth */
+    uint16_t hwm;      /* highest occupancy seen, 0 if not observable */
+    uint32_t resizes;
+};
+
+#define ISC_HIST_BUCKETS 32
+
+/* bucket i counts [2^i, 2^(i+1)) ns, the last one also everything above */
+struct isc_hist {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t bucket[ISC_HIST_BUCKETS];
+};
+
+/* ISC_OPT_TS only, the times of the consumer side come from the driver */
+struct isc_delay_stat {
+    struct isc_hist queue;   /* enqueued until picked up */
+    struct isc_hist handler; /* picked up until the handlers returned */
+};
+
+/* a received message handed out by recv(), see there */
+struct isc_slot {
+    void *data;
+    uint32_t len;
+    uint32_t idx; /* the library's, identifies the slot to release() */
 };
 
 struct isc_handle {
@@ -20,6 +59,61 @@ struct isc_handle {
     int (*send)(struct isc_handle *isc, void *msg, uint32_t len,
                 int32_t *result);
 
+    /*
+     * Fire and forget, returns once the message is queued. A failure is
+     * counted in oneway_errors() and passed to the oneway_failed listeners,
+     * which must not send on the same handle. A v1 queue still blocks until
+     * the driver took the message, and only a failed hand-over counts.
+     */
+    int (*send_oneway)(struct isc_handle *isc, const void *msg, uint32_t len);
+
+    uint64_t (*oneway_errors)(struct isc_handle *isc);
+
+    /*
+     * ISC_OPT_BUF: a buffer of at least buf_size bytes from the handle's
+     * pool, NULL once the pool is empty or if the handle has none.
+     */
+    void *(*buf_alloc)(struct isc_handle *isc, uint32_t *id);
+
+    void (*buf_free)(struct isc_handle *isc, uint32_t id);
+
+    /*
+     * Send len bytes at off of buffer id, only its descriptor goes through
+     * the queue. The buffer is the caller's again once a synchronous send
+     * returns, the driver may have written the reply into it. Sent one-way
+     * (result NULL or ISC_OPT_ONEWAY) it is the driver's to free, and
+     * oneway_failed sees the struct isc_buf_desc of the message.
+     * Buffers received in got() go back to the pool when got() returns.
+     */
+    int (*send_buf)(struct isc_handle *isc, uint32_t id, uint32_t off,
+                    uint32_t len, int32_t *result);
+
+    /* either of send and recv may be NULL */
+    int (*queue_stat)(struct isc_handle *isc, struct isc_queue_stat *send,
+                      struct isc_queue_stat *recv);
+
+    /* either of send and recv may be NULL */
+    int (*delay_stat)(struct isc_handle *isc, struct isc_delay_stat *send,
+                      struct isc_delay_stat *recv);
+
+    /*
+     * ISC_OPT_PULL: take up to n received messages straight out of the
+     * queue shared with the driver, from any number of threads. timeout_ms
+     * is -1 to wait for the first one, 0 to return at once, or the longest
+     * wait in milliseconds. Returns how many slots were filled, 0 on
+     * timeout. A slot holds up the queue behind it until it is released.
+     * got() is not called for such a handle, bound() and unbind() still are.
+     * The receive queue depth must be a power of 2.
+     */
+    int (*recv_many)(struct isc_handle *isc, struct isc_slot *slots,
+                     uint32_t n, int timeout_ms);
+
+    int (*recv)(struct isc_handle *isc, struct isc_slot *slot, int timeout_ms);
+
+    /* hand a slot back, rc is what got() would have returned */
+    int (*release)(struct isc_handle *isc, const struct isc_slot *slot,
+                   int32_t rc);
+
     int (*add_listener)(struct isc_handle *isc,
                         const struct isc_listener_ops *ops, void *arg);
 
@@ -32,10 +126,105 @@ struct isc_attr {
     uint16_t num; /* depth of user message queue, number of messages */
 };
 
+/* isc_opts.flags */
+#define ISC_OPT_NUMA     (0x00000001) /* bind queue memory to numa_node */
+#define ISC_OPT_RING     (0x00000002) /* shared ring indices if driver can */
+#define ISC_OPT_ONEWAY   (0x00000004) /* send() acts as send_oneway() */
+#define ISC_OPT_RESIZE   (0x00000008) /* follow occupancy within min/max_num */
+#define ISC_OPT_TS       (0x00000010) /* timestamp messages if the driver can */
+#define ISC_OPT_BUF      (0x00000020) /* out-of-band buffer pool, no sessions */
+#define ISC_OPT_URING    (0x00000040) /* io_uring v1 receive loop if it can */
+#define ISC_OPT_MODERATE (0x00000080) /* coalesce receive thread wake-ups */
+#define ISC_OPT_PULL     (0x00000100) /* recv() instead of got(), no sessions */
+#define ISC_OPT_REBIND   (0x00000200) /* ride out a peer reload, see backlog */
+
+struct isc_opts {
+    uint32_t flags;
+    /* receive thread, cpus only has to stay valid during the open call */
+    const int *cpus; /* CPUs the thread may run on, NULL for any */
+    uint32_t ncpus;
+    int policy;        /* SCHED_OTHER, SCHED_FIFO or SCHED_RR */
+    int priority;      /* static priority for SCHED_FIFO and SCHED_RR */
+    size_t stack_size; /* 0 for the default size */
+    /*
+     * ISC_OPT_NUMA: the driver is asked to allocate queues and pools on this
+     * node. Where it does not, the library falls back to mbind(), which only
+     * places anonymous memory and has no effect on pages of the driver.
+     */
+    int numa_node;
+    /* ISC_OPT_RING: busy polls of the peer index before sleeping */
+    uint32_t spin;
+    /*
+     * ISC_OPT_RESIZE: a v2 queue that filled up doubles up to max_num, one
+     * that stayed under a quarter full halves down to min_num. 0 keeps the
+     * depth given at open in that direction.
+     */
+    uint16_t min_num;
+    uint16_t max_num;
+    /* ISC_OPT_BUF: buffers of the pool shared with the driver */
+    uint32_t buf_size;
+    uint32_t buf_num;
+    /*
+     * ISC_OPT_MODERATE: once woken, the receive thread holds the burst for
+     * at most mod_usecs, the bound on the latency this adds, then handles
+     * all that arrived as one batch. Where the depth is visible (v2 rings,
+     * io_uring) it stops holding once mod_msgs are queued, 0 for never.
+     */
+    uint32_t mod_usecs;
+    uint32_t mod_msgs;
+    /*
+     * ISC_OPT_REBIND: the driver is asked to keep the queues and what they
+     * hold while the peer is away. Up to backlog one-way sends made until it
+     * bound again are kept and sent in order by the next send once it is
+     * back, ahead of its own message. 0 fails them as without the flag.
+     * Synchronous sends always fail.
+     */
+    uint32_t backlog;
+    /*
+     * Payloads of nt_min bytes and more are copied into the queue with
+     * non-temporal stores. 0 takes isc_copy_nt_min(), which is never for
+     * now, so streaming is off unless nt_min is set.
+     */
+    uint32_t nt_min;
+};
+
+
 int open_isc(uint32_t uid, struct isc_attr *s, /* send direction */
              struct isc_attr *r,               /* recv direction */
              struct isc_handle **isc);
 
+/* open_isc() with options, o may be NULL */
+int open_isc_ex(uint32_t uid, struct isc_attr *s, struct isc_attr *r,
+                const struct isc_opts *o, struct isc_handle **isc);
+
+/*
+ * Only valid inside got() for the msg it was given: the CLOCK_MONOTONIC
+ * times at which the driver queued the message and the receive thread
+ * picked it up. Returns -1 unless the handle was opened with ISC_OPT_TS and
+ * the driver stamped the message.
+ */
+int isc_msg_time(const void *msg, uint64_t *enq_ns, uint64_t *pickup_ns);
+
+/*
+ * A session binds many uids on one fd. The queues of all its handles are
+ * carved out of one mapping of `size` bytes and one receive thread serves
+ * them all. Handles opened from a session are closed as usual, before the
+ * session itself. The receive thread and memory options of a session are
+ * the ones given to open_isc_session(), those given to open() are ignored.
+ * Both fail with ISC_OPT_BUF or ISC_OPT_PULL, which sessions do not support.
+ */
+struct isc_session {
+    void (*close)(struct isc_session *sess);
+
+    int (*open)(struct isc_session *sess, uint32_t uid,
+                struct isc_attr *s, /* send direction */
+                struct isc_attr *r, /* recv direction */
+                const struct isc_opts *o, struct isc_handle **isc);
+};
+
+int open_isc_session(uint32_t size, const struct isc_opts *o,
+                     struct isc_session **sess);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,63 @@
+/* See LICENSE for license details */
+#ifndef _ISC_CAPTURE_H_
+#define _ISC_CAPTURE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Capture file layout: struct isc_cap_hdr followed by records packed in
+ * the order their space was reserved. A record is complete once its size
+ * is non-zero, the first incomplete one ends the capture.
+ */
+#define ISC_CAP_MAGIC   (0x50414349) /* "ICAP" */
+#define ISC_CAP_VERSION (1)
+#define ISC_CAP_ALIGN   (8)
+
+enum isc_cap_dir {
+    ISC_CAP_SEND, /* user to kernel, taken when the message is queued */
+    ISC_CAP_RECV, /* kernel to user, taken before the listeners run */
+};
+
+struct isc_cap_hdr {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size;    /* bytes of record space after the header */
+    uint64_t used;    /* bytes reserved, runs past size once full */
+    uint64_t dropped; /* records that did not fit */
+    uint64_t mono_ns; /* CLOCK_MONOTONIC at start */
+    uint64_t real_ns; /* CLOCK_REALTIME at start */
+    uint8_t rsvd[16];
+};
+
+struct isc_cap_rec {
+    uint32_t size;  /* bytes up to the next record, written last */
+    uint32_t uid;
+    uint64_t ts_ns; /* CLOCK_MONOTONIC */
+    uint32_t flags; /* struct isc_msg flags */
+    uint16_t seq;
+    uint16_t len;
+    uint8_t dir; /* enum isc_cap_dir */
+    uint8_t rsvd[7];
+    uint8_t d[0];
+};
+
+/*
+ * Record every message sent or received by any handle of the process into
+ * a file of `size` bytes mapped at path. Records that no longer fit are
+ * dropped and counted, a capture never blocks the sender or receiver.
+ */
+int isc_capture_start(const char *path, size_t size);
+
+/* waits for in-progress records, then trims the file to what was used */
+void isc_capture_stop(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _ISC_CAPTURE_H_ */
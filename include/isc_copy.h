@@ -0,0 +1,55 @@
+/* See LICENSE for license details */
+#ifndef _ISC_COPY_H_
+#define _ISC_COPY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Payload copies into queue memory. The peer reads a slot on another CPU,
+ * so from isc_opts.nt_min bytes on the library can copy with non-temporal
+ * stores that bypass the sender's cache instead of evicting its working set
+ * for data it never reads again. It does not by default.
+ */
+
+#define ISC_COPY_NT_NEVER UINT32_MAX
+
+enum isc_copy_kind {
+    ISC_COPY_LIBC,   /* plain memcpy() */
+    ISC_COPY_SSE2,   /* 16 byte streaming stores */
+    ISC_COPY_AVX2,   /* 32 byte streaming stores */
+    ISC_COPY_AVX512, /* 64 byte streaming stores */
+    ISC_COPY_KINDS,
+};
+
+typedef void (*isc_copy_fn)(void *dst, const void *src, size_t len);
+
+/* the kernel of a kind, NULL if this CPU or build cannot run it */
+isc_copy_fn isc_copy_kernel(enum isc_copy_kind kind);
+
+const char *isc_copy_name(enum isc_copy_kind kind);
+
+/* the widest streaming kernel this CPU runs, picked once */
+enum isc_copy_kind isc_copy_best(void);
+
+/*
+ * The smallest payload the best kernel streams by default. For now always
+ * ISC_COPY_NT_NEVER: streaming is off unless isc_opts.nt_min is set.
+ */
+uint32_t isc_copy_nt_min(void);
+
+/*
+ * Copy with the best streaming kernel, stores are fenced before it
+ * returns so publishing the slot afterwards needs no extra barrier.
+ */
+void isc_copy_nt(void *dst, const void *src, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _ISC_COPY_H_ */
@@ -0,0 +1,32 @@
+/* See LICENSE for license details */
+#ifndef _ISC_DEV_H_
+#define _ISC_DEV_H_
+
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Device access used by the ISC library. By default every operation goes
+ * straight to the system call on ISC_DEV_NAME. A stand-in driver (e.g. the
+ * one used by isc-bench) may install its own ops before any handle is opened.
+ */
+struct isc_dev_ops {
+    int (*open)(const char *path, int flags);
+    int (*close)(int fd);
+    int (*ioctl)(int fd, unsigned long req, void *arg);
+    void *(*mmap)(void *addr, size_t len, int prot, int flags, int fd,
+                  off_t off);
+    int (*munmap)(void *addr, size_t len);
+};
+
+/* NULL restores the default system call ops */
+void isc_set_dev_ops(const struct isc_dev_ops *ops);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _ISC_DEV_H_ */
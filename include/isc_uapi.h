@@ -11,14 +11,51 @@
 #define ISC_IOCTL_SEND    _IOWR(ISC_IOCTL_BASE, 1, struct isc_send)
 #define ISC_IOCTL_RECV    _IOWR(ISC_IOCTL_BASE, 2, struct isc_recv)
 #define ISC_IOCTL_CLOSE   _IOWR(ISC_IOCTL_BASE, 3, int)
+/* session: many uids on one fd, queues carved out of one pool mapping */
+#define ISC_IOCTL_POOL     _IOWR(ISC_IOCTL_BASE, 4, struct isc_pool)
+#define ISC_IOCTL_CH_BIND  _IOWR(ISC_IOCTL_BASE, 5, struct isc_chan_bind)
+#define ISC_IOCTL_CH_SEND  _IOWR(ISC_IOCTL_BASE, 6, struct isc_chan_xfer)
+#define ISC_IOCTL_CH_RECV  _IOWR(ISC_IOCTL_BASE, 7, struct isc_chan_xfer)
+#define ISC_IOCTL_CH_CLOSE _IOWR(ISC_IOCTL_BASE, 8, struct isc_chan_xfer)
+/* doorbell of protocol v2 rings */
+#define ISC_IOCTL_KICK     _IOWR(ISC_IOCTL_BASE, 9, struct isc_kick)
+/* v2 queue: rebind with another num, no link event, indices restart at 0 */
+#define ISC_IOCTL_RESIZE   _IOWR(ISC_IOCTL_BASE, 10, struct isc_bind2)
+/* out-of-band buffer pool of a plain file, mapped with struct isc_buf_ctrl */
+#define ISC_IOCTL_BUF_POOL _IOWR(ISC_IOCTL_BASE, 11, struct isc_buf_pool)
+/*
+ * IORING_OP_URING_CMD on a plain file, sqe->cmd holds struct isc_recv.
+ * Acks num messages as ISC_IOCTL_RECV does, num 0 acks none. The
+ * completion is the number of messages still queued or -errno.
+ */
+#define ISC_URING_CMD_RECV (1)
+/*
+ * ISC_IOCTL_BIND with protocol and feature negotiation. Only issued when a
+ * v2 ring or an ISC_FEAT_* is wanted, drivers that reject it get a plain
+ * ISC_IOCTL_BIND and grant v1 without features.
+ */
+#define ISC_IOCTL_BIND2    _IOWR(ISC_IOCTL_BASE, 12, struct isc_bind2)
 
-#define ISC_MSG_FLAG_USER (0x00000001)
+#define ISC_MSG_FLAG_USER   (0x00000001)
+#define ISC_MSG_FLAG_ONEWAY (0x00000002) /* nobody reads the reply */
+#define ISC_MSG_FLAG_TS     (0x00000004) /* d starts with struct isc_msg_ts */
+#define ISC_MSG_FLAG_BUF    (0x00000008) /* payload is struct isc_buf_desc */
 
 enum isc_bind_dir {
     ISC_BIND_U_2_K,
     ISC_BIND_K_2_U,
 };
 
+/* isc_bind2.feat */
+#define ISC_FEAT_TS   (0x0001) /* every slot carries struct isc_msg_ts */
+#define ISC_FEAT_WANT (0x0002) /* v2 producer honours isc_ring.cons_want */
+#define ISC_FEAT_KEEP (0x0004) /* queue and its indices outlive a peer unbind */
+#define ISC_FEAT_NODE (0x0008) /* queue pages come from NUMA node node */
+
+/* isc_bind2.ver */
+#define ISC_PROTO_V1 (1) /* one ioctl per message */
+#define ISC_PROTO_V2 (2) /* struct isc_ring indices, doorbell on sleep only */
+
 struct isc_bind {
     __u32 uid;
     __u16 msz;
@@ -29,6 +66,87 @@ struct isc_bind {
     __u64 mem;
 };
 
+/* struct isc_bind followed by the negotiated part */
+struct isc_bind2 {
+    __u32 uid;
+    __u16 msz;
+    __u16 num;
+    __u16 stat;
+    __u16 dir; /* enum isc_bind_dir */
+    __u32 size;
+    __u64 mem;
+    __u16 ver;  /* in: highest version wanted, out: version granted */
+    __u16 feat; /* in: ISC_FEAT_* wanted, out: granted */
+    __u32 ring; /* out: offset of struct isc_ring in the mapping for v2 */
+    __s32 node; /* ISC_FEAT_NODE */
+    __u32 rsvd;
+};
+
+/*
+ * Free running indices of a v2 queue, slots are used in order. Each side only
+ * writes its own cache line. A side that is about to sleep sets its wait
+ * flag and re-checks the other index, the other side rings ISC_IOCTL_KICK
+ * only when it sees that flag.
+ */
+struct isc_ring {
+    __u32 head;      /* written by the producer */
+    __u32 prod_wait; /* producer sleeps until tail moves */
+    __u8 rsvd0[56];
+    __u32 tail;      /* written by the consumer */
+    __u32 cons_wait; /* consumer sleeps until head moves */
+    __u32 cons_want; /* ISC_FEAT_WANT: no kick before head reaches it, 0 any */
+    __u8 rsvd1[52];
+};
+
+/* isc_kick.op */
+#define ISC_KICK_WAKE (1) /* wake the peer sleeping on the ring */
+#define ISC_KICK_WAIT (2) /* U2K: sleep until tail reaches idx */
+#define ISC_KICK_ARM  (3) /* K2U: clear fd readiness before polling */
+
+struct isc_kick {
+    __u16 dir; /* enum isc_bind_dir */
+    __u16 op;
+    __u32 idx;
+};
+
+struct isc_buf_pool {
+    __u32 bsz;  /* in: bytes per buffer, out: granted, never less */
+    __u32 num;  /* in: buffers wanted, out: granted */
+    __u64 size; /* out: bytes to map */
+    __u64 mem;  /* out: offset to map */
+    __s32 node; /* in: NUMA node of the pages, -1 any, out: -1 if not kept */
+    __u32 rsvd;
+};
+
+/*
+ * Head of the buffer pool mapping. Either side takes buffers off and puts
+ * them back on a lock-free stack: free holds a tag bumped on every change in
+ * its upper half and the id + 1 of the top buffer, 0 once empty, in its
+ * lower half. next[id] links a free buffer to the one below it the same way.
+ * The receiver of a one-way or kernel-to-user buffer frees it once handled,
+ * the buffer of a synchronous message goes back to its sender with the reply.
+ */
+struct isc_buf_ctrl {
+    __u64 free;
+    __u32 bsz;
+    __u32 num;
+    __u64 data;    /* offset of buffer 0 in the mapping */
+    __u32 next[0];
+};
+
+/* a message with ISC_MSG_FLAG_BUF, the data is the buffer id at off */
+struct isc_buf_desc {
+    __u32 id;
+    __u32 off;
+    __u32 len;
+    __u32 rsvd;
+};
+
+/*
+ * seq and num of struct isc_send, isc_recv and isc_chan_xfer name the
+ * messages seq, seq + 1, ... seq + num - 1: a batch carries the seq of its
+ * first message.
+ */
 struct isc_send {
     __u16 seq;
     __u16 num;
@@ -39,6 +157,35 @@ struct isc_recv {
     __u16 num;
 };
 
+#define ISC_SESSION_MAX (512) /* channels per session */
+
+struct isc_pool {
+    __u32 size; /* in: bytes for queues, out: bytes to map */
+    __s32 node; /* in: NUMA node of the pages, -1 any, out: -1 if not kept */
+    __u64 mem;
+};
+
+struct isc_chan_bind {
+    struct isc_bind2 b; /* b.mem is the queue offset inside the pool */
+    __u32 ch;           /* out: channel index in struct isc_pool_ctrl */
+    __u32 rsvd;
+};
+
+/* num == 0 on ISC_IOCTL_CH_RECV acks one link event of the channel */
+struct isc_chan_xfer {
+    __u32 ch;
+    __u16 seq;
+    __u16 num;
+};
+
+/* head of the pool mapping, followed by the queues */
+struct isc_pool_ctrl {
+    __u64 ready[ISC_SESSION_MAX / 64]; /* recvq of channel got messages */
+    __u64 event[ISC_SESSION_MAX / 64]; /* stat of channel changed */
+    __u32 posted[ISC_SESSION_MAX];     /* messages ever posted to recvq */
+    __u32 stat[ISC_SESSION_MAX];       /* 1 while the peer is bound */
+};
+
 struct isc_msg {
     __u32 flags;
     __u16 seq;
@@ -47,6 +194,13 @@ struct isc_msg {
     __u8 d[0];
 };
 
+/* CLOCK_MONOTONIC in ns, 0 until stamped, len does not include it */
+struct isc_msg_ts {
+    __u64 enq;    /* the producer queued the message */
+    __u64 pickup; /* the consumer took it off the queue */
+    __u64 done;   /* the consumer's handlers returned */
+};
+
 /* ISC internal msg ids */
 #define ISC_MSG_BOUND  (0x0001)
 #define ISC_MSG_UNBIND (0x0002)
@@ -0,0 +1,392 @@
+// See LICENSE for license details.
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "isc.h"
+#include "isc_capture.h"
+#include "isc_stub.h"
+#include "isc_uapi.h"
+
+#define LOGE(...) fprintf(stderr, __VA_ARGS__)
+
+#define REPLAY_MAX_UIDS 512
+
+struct replay_uid {
+    uint32_t uid;
+    uint16_t smsz, rmsz; /* largest message per direction, 0 if unused */
+    struct isc_handle *isc;
+};
+
+struct replay {
+    const struct isc_cap_hdr *hdr;
+    const uint8_t *end;
+    struct replay_uid uids[REPLAY_MAX_UIDS];
+    uint32_t nuids;
+    uint64_t *lat;
+    uint32_t nlat;
+    uint32_t sent, posted, failed;
+    atomic_uint got;
+    uint64_t max_lag;
+};
+
+static bool use_stub;
+static double speed = 1.0;
+static uint32_t only_uid;
+static bool has_only_uid;
+static uint16_t depth = 64;
+static struct isc_opts opts;
+
+static inline uint64_t replay_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void replay_sleep_until(uint64_t ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec = ns / 1000000000ull;
+    ts.tv_nsec = ns % 1000000000ull;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+           EINTR)
+        ;
+}
+
+static int32_t replay_got(void *msg, uint32_t len, void *arg)
+{
+    struct replay *rp = (struct replay *)arg;
+
+    atomic_fetch_add(&rp->got, 1);
+    return 0;
+}
+
+static const struct isc_listener_ops replay_listener_ops = {
+    .got = replay_got,
+};
+
+/* NULL once the capture ends or the next record is incomplete */
+static const struct isc_cap_rec *replay_next(struct replay *rp,
+                                             const struct isc_cap_rec *rec)
+{
+    const uint8_t *p;
+
+    if (!rec)
+        p = (const uint8_t *)(rp->hdr + 1);
+    else
+        p = (const uint8_t *)rec + rec->size;
+
+    if (p + sizeof(*rec) > rp->end)
+        return NULL;
+    rec = (const struct isc_cap_rec *)p;
+    if (!rec->size || rec->size < sizeof(*rec) + rec->len ||
+        p + rec->size > rp->end)
+        return NULL;
+    return rec;
+}
+
+/*
+ * User messages of the selected uids. Internal ones are not replayed, nor
+ * buffer descriptors, whose data was never captured.
+ */
+static bool replay_wanted(const struct isc_cap_rec *rec)
+{
+    if (!(rec->flags & ISC_MSG_FLAG_USER) || (rec->flags & ISC_MSG_FLAG_BUF))
+        return false;
+    if (has_only_uid && rec->uid != only_uid)
+        return false;
+    /* only the stand-in driver can play the kernel side */
+    return rec->dir == ISC_CAP_SEND || use_stub;
+}
+
+static struct replay_uid *replay_uid_of(struct replay *rp, uint32_t uid,
+                                        bool add)
+{
+    uint32_t i;
+
+    for (i = 0; i < rp->nuids; i++)
+        if (rp->uids[i].uid == uid)
+            return &rp->uids[i];
+
+    if (!add || rp->nuids == REPLAY_MAX_UIDS)
+        return NULL;
+    rp->uids[rp->nuids].uid = uid;
+    return &rp->uids[rp->nuids++];
+}
+
+static int replay_open(struct replay *rp)
+{
+    const struct isc_cap_rec *rec = NULL;
+    struct isc_attr s, r;
+    struct replay_uid *u;
+    uint32_t i, n = 0;
+    int rc;
+
+    while ((rec = replay_next(rp, rec))) {
+        if (!replay_wanted(rec))
+            continue;
+        u = replay_uid_of(rp, rec->uid, true);
+        if (!u) {
+            LOGE("more than %d uids in the capture\n", REPLAY_MAX_UIDS);
+            return -1;
+        }
+        if (rec->dir == ISC_CAP_SEND) {
+            if (rec->len > u->smsz)
+                u->smsz = rec->len;
+        } else if (rec->len > u->rmsz) {
+            u->rmsz = rec->len;
+        }
+        n++;
+    }
+
+    rp->lat = (uint64_t *)calloc(n ? n : 1, sizeof(*rp->lat));
+    if (!rp->lat)
+        return -1;
+
+    for (i = 0; i < rp->nuids; i++) {
+        u = &rp->uids[i];
+        s.msz = u->smsz;
+        s.num = depth;
+        r.msz = u->rmsz;
+        r.num = depth;
+        rc = open_isc_ex(u->uid, u->smsz ? &s : NULL, u->rmsz ? &r : NULL,
+                         &opts, &u->isc);
+        if (rc < 0) {
+            LOGE("failed to call open_isc (uid=0x%08x)\n", u->uid);
+            return rc;
+        }
+
+        rc = u->isc->add_listener(u->isc, &replay_listener_ops, rp);
+        if (rc < 0)
+            return rc;
+    }
+    return 0;
+}
+
+static void replay_close(struct replay *rp)
+{
+    uint32_t i;
+
+    for (i = 0; i < rp->nuids; i++)
+        if (rp->uids[i].isc)
+            rp->uids[i].isc->close(rp->uids[i].isc);
+    free(rp->lat);
+}
+
+static int replay_one(struct replay *rp, const struct isc_cap_rec *rec,
+                      uint8_t *buf)
+{
+    struct replay_uid *u = replay_uid_of(rp, rec->uid, false);
+    int32_t result = 0;
+    uint64_t t0;
+    int rc;
+
+    if (!u)
+        return -1;
+
+    if (rec->dir == ISC_CAP_RECV) {
+        rc = isc_stub_post(rec->uid, rec->d, rec->len);
+        if (rc == 0)
+            rp->posted++;
+        return rc;
+    }
+
+    /* send() writes the reply back, never into the mapped capture */
+    memcpy(buf, rec->d, rec->len);
+    t0 = replay_now();
+    rc = u->isc->send(u->isc, buf, rec->len, &result);
+    if (rc < 0 || result < 0)
+        return -1;
+    rp->lat[rp->nlat++] = replay_now() - t0;
+    rp->sent++;
+    return 0;
+}
+
+static void replay_run(struct replay *rp)
+{
+    const struct isc_cap_rec *rec = NULL;
+    uint64_t first = 0, t0, due, now;
+    uint8_t buf[UINT16_MAX];
+    int64_t at;
+
+    t0 = replay_now();
+    while ((rec = replay_next(rp, rec))) {
+        if (!replay_wanted(rec))
+            continue;
+        if (!first)
+            first = rec->ts_ns;
+
+        if (speed > 0) {
+            /* producers racing for the capture may stamp out of order */
+            at = (int64_t)(rec->ts_ns - first);
+            due = t0 + (at > 0 ? (uint64_t)(at / speed) : 0);
+            now = replay_now();
+            if (now < due)
+                replay_sleep_until(due);
+            else if (now - due > rp->max_lag)
+                rp->max_lag = now - due;
+        }
+
+        if (replay_one(rp, rec, buf) < 0)
+            rp->failed++;
+    }
+}
+
+static int replay_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t replay_pct(uint64_t *lat, uint32_t n, uint32_t permille)
+{
+    uint64_t i;
+
+    if (!n)
+        return 0;
+    i = (uint64_t)n * permille / 1000;
+    return lat[i < n ? i : n - 1];
+}
+
+static void replay_report(struct replay *rp, const char *path, uint64_t ns)
+{
+    double secs = ns / 1e9;
+    uint32_t n = rp->sent + rp->posted;
+
+    qsort(rp->lat, rp->nlat, sizeof(*rp->lat), replay_cmp);
+    printf("{\"file\":\"%s\",\"speed\":%g,\"uids\":%u,\"sent\":%u,"
+           "\"posted\":%u,\"got\":%u,\"failed\":%u,\"dropped\":%llu,"
+           "\"secs\":%.6f,\"msgs_per_sec\":%.0f,\"max_lag_ns\":%llu,"
+           "\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu}\n",
+           path, speed, rp->nuids, rp->sent, rp->posted,
+           atomic_load(&rp->got), rp->failed,
+           (unsigned long long)rp->hdr->dropped, secs,
+           secs > 0 ? n / secs : 0, (unsigned long long)rp->max_lag,
+           (unsigned long long)replay_pct(rp->lat, rp->nlat, 500),
+           (unsigned long long)replay_pct(rp->lat, rp->nlat, 990),
+           (unsigned long long)replay_pct(rp->lat, rp->nlat, 999));
+    fflush(stdout);
+}
+
+static void replay_usage(const char *name)
+{
+    LOGE("usage: %s [-t] [-R] [-o] [-x speed] [-u uid] [-n num] file\n"
+         "  -t  use the built-in stand-in driver, also replays the\n"
+         "      kernel-to-user messages of the capture\n"
+         "  -R  use the shared ring fast path (protocol v2)\n"
+         "  -o  send one-way, without waiting for the reply\n"
+         "  -x  1 keeps the original pacing (default), N replays N times\n"
+         "      faster, 0 sends back to back\n"
+         "  -u  only replay the messages of this uid\n"
+         "  -n  queue depth of the replay handles (default 64)\n"
+         "The result is printed as one JSON object.\n",
+         name);
+}
+
+int main(int argc, char *argv[])
+{
+    struct replay *rp;
+    const char *path;
+    struct stat st;
+    uint64_t t0, t1;
+    void *mem;
+    int fd, opt, rc, i;
+
+    while ((opt = getopt(argc, argv, "tRox:u:n:h")) != -1) {
+        switch (opt) {
+        case 't':
+            use_stub = true;
+            break;
+        case 'R':
+            opts.flags |= ISC_OPT_RING;
+            break;
+        case 'o':
+            opts.flags |= ISC_OPT_ONEWAY;
+            break;
+        case 'x':
+            speed = strtod(optarg, NULL);
+            if (speed < 0)
+                goto _usage;
+            break;
+        case 'u':
+            only_uid = strtoul(optarg, NULL, 0);
+            has_only_uid = true;
+            break;
+        case 'n':
+            depth = strtoul(optarg, NULL, 0);
+            if (!depth)
+                goto _usage;
+            break;
+        default:
+            goto _usage;
+        }
+    }
+
+    if (optind != argc - 1)
+        goto _usage;
+    path = argv[optind];
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        LOGE("failed to open %s (rc=%s)\n", path, strerror(errno));
+        return -1;
+    }
+
+    mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (st.st_size < sizeof(struct isc_cap_hdr) || mem == MAP_FAILED) {
+        LOGE("failed to map %s\n", path);
+        return -1;
+    }
+
+    rp = (struct replay *)calloc(1, sizeof(*rp));
+    if (!rp)
+        return -1;
+    rp->hdr = (const struct isc_cap_hdr *)mem;
+    rp->end = (const uint8_t *)mem + st.st_size;
+    if (rp->hdr->magic != ISC_CAP_MAGIC ||
+        rp->hdr->version != ISC_CAP_VERSION) {
+        LOGE("%s is not an ISC capture\n", path);
+        return -1;
+    }
+
+    if (use_stub)
+        isc_stub_install();
+
+    rc = replay_open(rp);
+    if (rc == 0) {
+        t0 = replay_now();
+        replay_run(rp);
+        for (i = 0; i < rp->nuids; i++)
+            if (rp->uids[i].smsz)
+                rp->failed +=
+                    rp->uids[i].isc->oneway_errors(rp->uids[i].isc);
+        t1 = replay_now();
+        /* give the receive threads a moment to catch up */
+        for (i = 0; i < 1000 && atomic_load(&rp->got) < rp->posted; i++)
+            usleep(1000);
+        replay_report(rp, path, t1 - t0);
+    }
+
+    replay_close(rp);
+    munmap(mem, st.st_size);
+    free(rp);
+    return rc;
+
+_usage:
+    replay_usage(argv[0]);
+    return -1;
+}
@@ -36,10 +36,20 @@ static void sample_unbind(void *arg)
 {
 }
 
+static void sample_oneway_failed(const void *msg, uint32_t len, int32_t rc,
+                                 void *arg)
+{
+    const struct sample_msg *m = (const struct sample_msg *)msg;
+
+    if (m->id == SAMPLE_MSG_WRITE_REG)
+        LOGE("failed to write reg (0x%08x) (rc=%d)\n", m->reg.offset, rc);
+}
+
 static const struct isc_listener_ops sample_listener_ops = {
     .bound = sample_bound,
     .unbind = sample_unbind,
     .got = sample_msg_handler,
+    .oneway_failed = sample_oneway_failed,
 };
 
 static int sample_open(uint32_t id, struct sample_data **ppdata)
@@ -103,7 +113,6 @@ static int sample_reg_write(struct sample_data *pdata, uint32_t offset,
                             uint32_t value)
 {
     struct sample_msg msg;
-    int32_t result;
     int rc;
 
     if (!pdata)
@@ -112,8 +121,9 @@ static int sample_reg_write(struct sample_data *pdata, uint32_t offset,
     msg.id = SAMPLE_MSG_WRITE_REG;
     msg.reg.offset = offset;
     msg.reg.value = value;
-    rc = pdata->isc->send(pdata->isc, &msg, sizeof(msg), &result);
-    if (rc < 0 || result < 0)
+    /* nothing to read back, a failure reaches sample_oneway_failed */
+    rc = pdata->isc->send_oneway(pdata->isc, &msg, sizeof(msg));
+    if (rc < 0)
         return -1;
 
     return 0;
@@ -1,8 +1,14 @@
 // See LICENSE for license details.
+#define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <poll.h>
+#include <linux/futex.h>
+#include <linux/io_uring.h>
+#include <linux/mempolicy.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,19 +16,29 @@
 #include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "isc_uapi.h"
 #include "list.h"
 
 #include "isc.h"
+#include "isc_capture.h"
+#include "isc_copy.h"
+#include "isc_dev.h"
 
 #ifndef ARRAY_SIZE
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(*(x)))
 #endif
 
-#define ISC_DEV_NAME "/dev/isc"
-#define LOGE(...)    fprintf(stderr, __VA_ARGS__)
+#define ISC_DEV_NAME       "/dev/isc"
+#define ISC_MAX_NUMA_NODES 1024
+#define ISC_RING_SPIN      256
+#define ISC_RESIZE_WINDOW  256 /* minimum messages between two decisions */
+#define ISC_URING_DEPTH    8
+#define ISC_SESS_NO_OPTS   (ISC_OPT_BUF | ISC_OPT_PULL)
+#define LOGE(...)          fprintf(stderr, __VA_ARGS__)
 
 enum isc_direct {
     ISC_DIR_SEND = 1,
@@ -30,6 +46,31 @@ enum isc_direct {
     ISC_DIR_BIDIRECTION = 3,
 };
 
+static int isc_sys_open(const char *path, int flags)
+{
+    return open(path, flags);
+}
+
+static int isc_sys_ioctl(int fd, unsigned long req, void *arg)
+{
+    return ioctl(fd, req, arg);
+}
+
+static const struct isc_dev_ops isc_sys_ops = {
+    .open = isc_sys_open,
+    .close = close,
+    .ioctl = isc_sys_ioctl,
+    .mmap = mmap,
+    .munmap = munmap,
+};
+
+static const struct isc_dev_ops *isc_dev = &isc_sys_ops;
+
+void isc_set_dev_ops(const struct isc_dev_ops *ops)
+{
+    isc_dev = ops ? ops : &isc_sys_ops;
+}
+
 struct isc_listener {
     const struct isc_listener_ops *ops;
     void *arg;
@@ -39,48 +80,270 @@ struct isc_queue {
     struct list *wp, *rp;
     void *mem;
     uint32_t size;
+    uint16_t msz, num;
+    uint32_t done;         /* session recvq: consumed, v2 sendq: reaped */
+    struct isc_ring *ring; /* protocol v2 only */
+    /* occupancy, updated by the side that consumes or produces */
+    uint16_t hwm;    /* high-watermark of the current resize window */
+    uint32_t window; /* messages in the current resize window */
+    bool fixed;      /* the driver cannot resize it */
+    bool ts;         /* slots carry struct isc_msg_ts */
+    bool want;       /* the producer honours ring->cons_want */
+    bool keep;       /* the driver keeps it across a peer unbind */
+    bool node;       /* the driver allocated it on opts.numa_node */
+    struct isc_queue_stat stat;
+    struct isc_delay_stat delay;
+};
+
+struct isc_task {
+    pthread_t handle;
+    int efd;
+    bool is_started;
+};
+
+/*
+ * ISC_OPT_PULL: recvq slots go straight to the threads in recv(). They
+ * claim slots in order with a CAS on next, and whoever releases the oldest
+ * one hands every slot released in order back to the driver. On v2 the
+ * ring indices stand in for head and tail.
+ */
+struct isc_pull {
+    uint32_t next; /* next slot to claim */
+    uint8_t pad0[60];
+    uint32_t tail; /* v1: oldest slot not released */
+    uint8_t pad1[60];
+    uint32_t gen;  /* futex, bumped whenever slots are published */
+    uint32_t waiters;
+    uint32_t head;       /* v1: slots published by the receive thread */
+    uint32_t seen;       /* v2: head last published */
+    struct isc_msg *msg; /* v1: the only slot out at a time */
+    uint64_t *done;      /* index + 1 of each released slot */
+    pthread_mutex_t lock; /* delay accounting */
 };
 
+/* ISC_OPT_REBIND: a one-way send made while the peer was away */
+struct isc_held {
+    uint32_t len;
+    uint32_t flags;
+    uint8_t d[0];
+};
+
+/* a one-way failure found under send_lock, reported once it is dropped */
+struct isc_failed {
+    uint32_t len;
+    int32_t rc;
+    uint8_t d[0];
+};
+
+struct isc_sess;
+
 struct isc_device {
     struct isc_handle isc;
     uint32_t direct;
     uint32_t uid;
-    int fd, efd;
-    bool is_task_started;
-    pthread_t task_handle;
+    int fd;
+    struct isc_opts opts;
+    struct isc_task task;
+    struct isc_sess *sess; /* NULL unless opened from a session */
+    uint32_t ch;
     struct isc_queue sendq, recvq;
     uint32_t seq;
     pthread_mutex_t send_lock;
     bool send_ready, recv_ready;
+    uint64_t oneway_errors; /* under send_lock */
+    uint8_t *held;          /* ISC_OPT_REBIND backlog, under send_lock */
+    uint32_t held_first, held_cnt;
+    uint8_t *failed; /* struct isc_failed records, under send_lock */
+    uint32_t failed_used, failed_size;
+    struct isc_buf_ctrl *buf; /* ISC_OPT_BUF pool mapping */
+    uint64_t buf_size;
+    struct isc_pull pull;
     pthread_mutex_t listener_lock;
     struct list *listener_list;
 };
 
+struct isc_sess {
+    struct isc_session session;
+    struct isc_opts opts;
+    int fd;
+    struct isc_task task;
+    uint8_t *mem;
+    uint32_t size;
+    struct isc_pool_ctrl *ctrl;
+    pthread_mutex_t lock;
+    struct isc_device *chans[ISC_SESSION_MAX];
+};
+
+static inline uint64_t isc_clock_ns(clockid_t id)
+{
+    struct timespec ts;
+
+    clock_gettime(id, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline struct isc_msg_ts *isc_msg_ts(struct isc_msg *m)
+{
+    return m->flags & ISC_MSG_FLAG_TS ? (struct isc_msg_ts *)m->d : NULL;
+}
+
+static inline void *isc_msg_data(struct isc_msg *m)
+{
+    return m->flags & ISC_MSG_FLAG_TS ? m->d + sizeof(struct isc_msg_ts)
+                                      : m->d;
+}
+
+static inline uint16_t isc_queue_feat(struct isc_queue *q)
+{
+    return (q->ts ? ISC_FEAT_TS : 0) | (q->want ? ISC_FEAT_WANT : 0) |
+           (q->keep ? ISC_FEAT_KEEP : 0) | (q->node ? ISC_FEAT_NODE : 0);
+}
+
+/* node the driver is asked to allocate memory on, -1 for any */
+static inline int isc_mem_node(const struct isc_opts *o)
+{
+    if (!(o->flags & ISC_OPT_NUMA))
+        return -1;
+    if (o->numa_node < 0 || o->numa_node >= ISC_MAX_NUMA_NODES) {
+        LOGE("invalid numa node %d\n", o->numa_node);
+        return -1;
+    }
+    return o->numa_node;
+}
+
+static inline uint32_t isc_slot_size(uint32_t msz, bool ts)
+{
+    return msz + sizeof(struct isc_msg) + (ts ? sizeof(struct isc_msg_ts) : 0);
+}
+
+static void isc_hist_add(struct isc_hist *h, uint64_t ns)
+{
+    uint32_t i = ns ? 63 - __builtin_clzll(ns) : 0;
+
+    h->count++;
+    h->sum_ns += ns;
+    h->bucket[i < ISC_HIST_BUCKETS ? i : ISC_HIST_BUCKETS - 1]++;
+}
+
+/* a slot is done, record whatever both sides stamped */
+static void isc_account(struct isc_delay_stat *st, const struct isc_msg_ts *ts)
+{
+    if (!ts || !ts->enq || !ts->pickup || ts->pickup < ts->enq)
+        return;
+
+    isc_hist_add(&st->queue, ts->pickup - ts->enq);
+    if (ts->done >= ts->pickup)
+        isc_hist_add(&st->handler, ts->done - ts->pickup);
+}
+
+static inline void *isc_buf_at(struct isc_buf_ctrl *b, uint32_t id)
+{
+    return (uint8_t *)b + b->data + (uint64_t)id * b->bsz;
+}
+
+/* the tag in the upper half keeps a stale top from winning the swap */
+static bool isc_buf_pop(struct isc_buf_ctrl *b, uint32_t *id)
+{
+    uint64_t old = __atomic_load_n(&b->free, __ATOMIC_ACQUIRE), top;
+    uint32_t next;
+
+    do {
+        if (!(uint32_t)old)
+            return false;
+        next = __atomic_load_n(&b->next[(uint32_t)old - 1], __ATOMIC_RELAXED);
+        top = ((old >> 32) + 1) << 32 | next;
+    } while (!__atomic_compare_exchange_n(&b->free, &old, top, true,
+                                          __ATOMIC_ACQUIRE,
+                                          __ATOMIC_ACQUIRE));
+
+    *id = (uint32_t)old - 1;
+    return true;
+}
+
+static void isc_buf_push(struct isc_buf_ctrl *b, uint32_t id)
+{
+    uint64_t old = __atomic_load_n(&b->free, __ATOMIC_RELAXED), top;
+
+    do {
+        __atomic_store_n(&b->next[id], (uint32_t)old, __ATOMIC_RELAXED);
+        top = ((old >> 32) + 1) << 32 | (id + 1);
+    } while (!__atomic_compare_exchange_n(&b->free, &old, top, true,
+                                          __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED));
+}
+
+/* the data a ISC_MSG_FLAG_BUF message points at, NULL if out of the pool */
+static void *isc_buf_data(struct isc_device *idev, struct isc_buf_desc *d)
+{
+    struct isc_buf_ctrl *b = idev->buf;
+
+    if (!b || d->id >= b->num || d->off > b->bsz || d->len > b->bsz - d->off)
+        return NULL;
+    return (uint8_t *)isc_buf_at(b, d->id) + d->off;
+}
+
+/* the message being dispatched by this receive thread, see isc_msg_time() */
+static __thread struct isc_msg *isc_cur_msg;
+static __thread void *isc_cur_data;
+
+/*
+ * The handle whose listeners this thread is calling. Failures its own sends
+ * find meanwhile wait for listener_lock to be dropped, see isc_unlock_send().
+ */
+static __thread struct isc_device *isc_listening;
+static __thread bool isc_deferred;
+
+static void isc_report_deferred(struct isc_device *idev);
+
 static void isc_handle_user_msg(struct isc_device *idev, struct isc_msg *msg)
 {
+    struct isc_buf_desc *desc = NULL;
     struct isc_listener *li;
     struct list *pos;
-    int32_t rc = 0;
+    int32_t rc = -1;
+    uint32_t len;
+    void *data;
 
     if (!msg)
         return;
 
+    data = isc_msg_data(msg);
+    len = msg->len;
+    if (msg->flags & ISC_MSG_FLAG_BUF) {
+        desc = (struct isc_buf_desc *)data;
+        data = len >= sizeof(*desc) ? isc_buf_data(idev, desc) : NULL;
+        if (!data) {
+            LOGE("bad buffer descriptor (uid=0x%08x)\n", idev->uid);
+            msg->rc = -1;
+            return;
+        }
+        len = desc->len;
+    }
+
     pthread_mutex_lock(&idev->listener_lock);
     pos = idev->listener_list;
-    if (!pos) {
-        pthread_mutex_unlock(&idev->listener_lock);
-        msg->rc = -1;
-        return;
-    }
+    if (!pos)
+        goto _exit;
 
+    rc = 0;
+    isc_cur_msg = msg;
+    isc_cur_data = data;
+    isc_listening = idev;
     do {
         li = (struct isc_listener *)list_get(pos, NULL);
         if (li->ops->got)
-            rc |= li->ops->got(msg->d, msg->len, li->arg);
+            rc |= li->ops->got(data, len, li->arg);
         pos = list_next(pos);
     } while (pos != idev->listener_list);
+    isc_listening = NULL;
+    isc_cur_msg = NULL;
+    isc_cur_data = NULL;
 
+_exit:
     pthread_mutex_unlock(&idev->listener_lock);
+    isc_report_deferred(idev);
+    if (desc)
+        isc_buf_push(idev->buf, desc->id);
     msg->rc = rc;
 }
 
@@ -96,6 +359,7 @@ static void isc_notify_listener(struct isc_device *idev, bool is_bound)
         return;
     }
 
+    isc_listening = idev;
     do {
         li = (struct isc_listener *)list_get(pos, NULL);
         if (is_bound) {
@@ -107,30 +371,128 @@ static void isc_notify_listener(struct isc_device *idev, bool is_bound)
         }
         pos = list_next(pos);
     } while (pos != idev->listener_list);
+    isc_listening = NULL;
 
     pthread_mutex_unlock(&idev->listener_lock);
+    isc_report_deferred(idev);
 }
 
-static void isc_handle_int_msg(struct isc_device *idev, struct isc_msg *msg)
+static inline uint32_t isc_failed_size(uint32_t len)
 {
-    struct isc_int_msg *imsg;
+    return (sizeof(struct isc_failed) + len + 7) & ~7u;
+}
 
-    if (!msg)
+/*
+ * A one-way message failed or never got queued, send_lock held. Listeners
+ * are not called here: a got() sending on its own handle holds
+ * listener_lock while it waits for send_lock. The message is kept until
+ * isc_unlock_send() reports it.
+ */
+static void isc_oneway_failed(struct isc_device *idev, const void *msg,
+                              uint32_t len, int32_t rc)
+{
+    uint32_t sz = isc_failed_size(len), size;
+    struct isc_failed *f;
+    uint8_t *buf;
+
+    idev->oneway_errors++;
+
+    if (idev->failed_used + sz > idev->failed_size) {
+        size = idev->failed_size ? idev->failed_size : 4096;
+        while (size < idev->failed_used + sz)
+            size *= 2;
+        buf = (uint8_t *)realloc(idev->failed, size);
+        if (!buf) {
+            LOGE("one-way failure not reported (uid=0x%08x rc=%d)\n",
+                 idev->uid, rc);
+            return;
+        }
+        idev->failed = buf;
+        idev->failed_size = size;
+    }
+
+    f = (struct isc_failed *)(idev->failed + idev->failed_used);
+    f->len = len;
+    f->rc = rc;
+    memcpy(f->d, msg, len);
+    idev->failed_used += sz;
+}
+
+static void isc_report_failed(struct isc_device *idev, const uint8_t *buf,
+                              uint32_t used)
+{
+    const struct isc_failed *f;
+    struct isc_listener *li;
+    struct list *pos;
+    uint32_t off;
+
+    pthread_mutex_lock(&idev->listener_lock);
+    pos = idev->listener_list;
+    if (!pos) {
+        pthread_mutex_unlock(&idev->listener_lock);
         return;
+    }
 
-    imsg = (struct isc_int_msg *)msg->d;
+    for (off = 0; off < used; off += isc_failed_size(f->len)) {
+        f = (const struct isc_failed *)(buf + off);
+        do {
+            li = (struct isc_listener *)list_get(pos, NULL);
+            if (li->ops->oneway_failed)
+                li->ops->oneway_failed(f->d, f->len, f->rc, li->arg);
+            pos = list_next(pos);
+        } while (pos != idev->listener_list);
+    }
 
-    switch (imsg->id) {
-    case ISC_MSG_BOUND:
+    pthread_mutex_unlock(&idev->listener_lock);
+}
+
+/*
+ * Drop send_lock, then pass what failed under it to the listeners. A send
+ * from a listener of the same handle leaves it to isc_report_deferred().
+ */
+static void isc_unlock_send(struct isc_device *idev)
+{
+    uint32_t used = idev->failed_used;
+    uint8_t *buf = idev->failed;
+
+    if (used && isc_listening == idev)
+        isc_deferred = true;
+    if (!used || isc_listening == idev) {
+        pthread_mutex_unlock(&idev->send_lock);
+        return;
+    }
+
+    idev->failed = NULL;
+    idev->failed_used = 0;
+    idev->failed_size = 0;
+    pthread_mutex_unlock(&idev->send_lock);
+
+    isc_report_failed(idev, buf, used);
+    free(buf);
+}
+
+static void isc_report_deferred(struct isc_device *idev)
+{
+    if (!isc_deferred)
+        return;
+
+    isc_deferred = false;
+    pthread_mutex_lock(&idev->send_lock);
+    isc_unlock_send(idev);
+}
+
+static void isc_set_link(struct isc_device *idev, bool is_bound)
+{
+    if (is_bound) {
         if (idev->direct & ISC_DIR_RECV)
             idev->recv_ready = true;
+        /* what was held goes out with the next send, on its thread */
         pthread_mutex_lock(&idev->send_lock);
         if (idev->direct & ISC_DIR_SEND)
             idev->send_ready = true;
         pthread_mutex_unlock(&idev->send_lock);
         isc_notify_listener(idev, true);
-        break;
-    case ISC_MSG_UNBIND:
+    } else {
         isc_notify_listener(idev, false);
         pthread_mutex_lock(&idev->send_lock);
         if (idev->direct & ISC_DIR_SEND)
@@ -138,6 +500,24 @@ static void isc_handle_int_msg(struct isc_device *idev, struct isc_msg *msg)
         pthread_mutex_unlock(&idev->send_lock);
         if (idev->direct & ISC_DIR_RECV)
             idev->recv_ready = false;
+    }
+}
+
+static void isc_handle_int_msg(struct isc_device *idev, struct isc_msg *msg)
+{
+    struct isc_int_msg *imsg;
+
+    if (!msg)
+        return;
+
+    imsg = (struct isc_int_msg *)isc_msg_data(msg);
+
+    switch (imsg->id) {
+    case ISC_MSG_BOUND:
+        isc_set_link(idev, true);
+        break;
+    case ISC_MSG_UNBIND:
+        isc_set_link(idev, false);
         break;
     default:
         break;
@@ -145,119 +525,980 @@ static void isc_handle_int_msg(struct isc_device *idev, struct isc_msg *msg)
     msg->rc = 0;
 }
 
+static struct isc_cap_hdr *isc_cap;
+static uint32_t isc_cap_users;
+static int isc_cap_fd = -1;
+static pthread_mutex_t isc_cap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void isc_capture_msg(struct isc_cap_hdr *h, uint32_t uid,
+                            uint8_t dir, struct isc_msg *m, const void *data)
+{
+    uint64_t ts = isc_clock_ns(CLOCK_MONOTONIC);
+    struct isc_cap_rec *rec;
+    uint64_t off, sz;
+
+    /* stamped before reserving, so records only race by that window */
+    sz = sizeof(*rec) + m->len;
+    sz = (sz + ISC_CAP_ALIGN - 1) & ~(uint64_t)(ISC_CAP_ALIGN - 1);
+    off = __atomic_fetch_add(&h->used, sz, __ATOMIC_RELAXED);
+    if (off + sz > h->size) {
+        __atomic_add_fetch(&h->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    rec = (struct isc_cap_rec *)((uint8_t *)(h + 1) + off);
+    rec->uid = uid;
+    rec->ts_ns = ts;
+    rec->flags = m->flags & ~ISC_MSG_FLAG_TS;
+    rec->seq = m->seq;
+    rec->len = m->len;
+    rec->dir = dir;
+    memcpy(rec->d, data, m->len);
+    __atomic_store_n(&rec->size, sz, __ATOMIC_RELEASE);
+}
+
+/*
+ * Costs one relaxed load while no capture is running. The payload is read
+ * from data, the sender's own copy, rather than from a slot it may have
+ * just filled with streaming stores.
+ */
+static inline void isc_capture(struct isc_device *idev, uint8_t dir,
+                               struct isc_msg *m, const void *data)
+{
+    struct isc_cap_hdr *h;
+
+    if (!__atomic_load_n(&isc_cap, __ATOMIC_RELAXED))
+        return;
+
+    /* isc_capture_stop() unmaps only once no user is left */
+    __atomic_add_fetch(&isc_cap_users, 1, __ATOMIC_SEQ_CST);
+    h = __atomic_load_n(&isc_cap, __ATOMIC_SEQ_CST);
+    if (h)
+        isc_capture_msg(h, idev->uid, dir, m, data);
+    __atomic_sub_fetch(&isc_cap_users, 1, __ATOMIC_RELEASE);
+}
+
+/* in ISC_OPT_PULL mode consumer threads account too, under pull.lock */
+static void isc_account_recv(struct isc_device *idev,
+                             const struct isc_msg_ts *ts)
+{
+    if (idev->pull.done)
+        pthread_mutex_lock(&idev->pull.lock);
+    isc_account(&idev->recvq.delay, ts);
+    if (idev->pull.done)
+        pthread_mutex_unlock(&idev->pull.lock);
+}
+
 static inline void isc_handle_msg(struct isc_device *idev, struct isc_msg *msg)
 {
+    struct isc_msg_ts *ts = isc_msg_ts(msg);
+
+    if (ts)
+        ts->pickup = isc_clock_ns(CLOCK_MONOTONIC);
+    isc_capture(idev, ISC_CAP_RECV, msg, isc_msg_data(msg));
     if (msg->flags & ISC_MSG_FLAG_USER)
         isc_handle_user_msg(idev, msg);
     else
         isc_handle_int_msg(idev, msg);
+    if (ts) {
+        ts->done = isc_clock_ns(CLOCK_MONOTONIC);
+        isc_account_recv(idev, ts);
+    }
 }
 
-static int isc_send_ack(int fd, uint32_t seq)
+static int isc_send_ack(int fd, uint16_t seq, uint16_t num)
 {
     struct isc_recv recv;
     int rc;
 
     memset(&recv, 0, sizeof(recv));
-    recv.num = 1;
+    recv.num = num;
     recv.seq = seq;
-    rc = ioctl(fd, ISC_IOCTL_RECV, &recv);
+    rc = isc_dev->ioctl(fd, ISC_IOCTL_RECV, &recv);
     if (rc < 0)
         LOGE("failed to ioctl ISC_IOCTL_RECV (rc=%s)\n", strerror(errno));
     return rc;
 }
 
-static void *isc_task_handler(void *arg)
+static inline void isc_cpu_relax(void)
 {
-    struct isc_device *idev = (struct isc_device *)arg;
-    struct pollfd fds[2];
-    struct isc_msg *m;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield" ::: "memory");
+#else
+    __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+static inline uint32_t isc_spin(struct isc_device *idev)
+{
+    return idev->opts.spin ? idev->opts.spin : ISC_RING_SPIN;
+}
+
+static inline uint32_t isc_nt_min(struct isc_device *idev)
+{
+    return idev->opts.nt_min ? idev->opts.nt_min : isc_copy_nt_min();
+}
+
+static inline void isc_track(struct isc_queue *q, uint32_t occupancy,
+                             uint32_t n)
+{
+    if (occupancy > q->hwm)
+        q->hwm = occupancy;
+    if (occupancy > q->stat.hwm)
+        q->stat.hwm = occupancy;
+    q->window += n;
+}
+
+/* new depth once a resize window is over, 0 to keep the current one */
+static uint16_t isc_resize_target(struct isc_device *idev, struct isc_queue *q)
+{
+    uint32_t min = idev->opts.min_num, max = idev->opts.max_num;
+    uint32_t num = 0;
+
+    if (!(idev->opts.flags & ISC_OPT_RESIZE) || !q->ring || q->fixed ||
+        q->window < ISC_RESIZE_WINDOW || q->window < 4u * q->num)
+        return 0;
+
+    /* a full queue stalled its producer, a mostly idle one wastes memory */
+    if (q->hwm >= q->num && max > q->num)
+        num = q->num * 2 < max ? q->num * 2 : max;
+    else if (q->hwm <= q->num / 4 && min && min < q->num)
+        num = q->num / 2 > min ? q->num / 2 : min;
+
+    q->hwm = 0;
+    q->window = 0;
+    return num;
+}
+
+static int isc_ring_kick(struct isc_device *idev, uint16_t dir, uint16_t op,
+                         uint32_t idx)
+{
+    struct isc_kick kick;
     int rc;
 
-    if (!idev)
-        return NULL;
+    memset(&kick, 0, sizeof(kick));
+    kick.dir = dir;
+    kick.op = op;
+    kick.idx = idx;
+    rc = isc_dev->ioctl(idev->fd, ISC_IOCTL_KICK, &kick);
+    if (rc < 0)
+        LOGE("failed to ioctl ISC_IOCTL_KICK (rc=%s)\n", strerror(errno));
+    return rc;
+}
 
-    memset(fds, 0, sizeof(fds));
-    fds[0].fd = idev->fd;
-    fds[1].fd = idev->efd;
-    fds[0].events = POLLIN;
-    fds[1].events = POLLIN;
+/* consume every published slot of a v2 recvq, returns how many */
+static int isc_resize_queue(struct isc_device *idev, struct isc_queue *q,
+                            uint16_t dir, uint16_t num);
 
-    while (idev->is_task_started) {
-        fds[0].revents = 0;
-        rc = poll(fds, ARRAY_SIZE(fds), -1);
-        if (rc <= 0)
-            continue;
-        if (!(fds[0].revents & POLLIN))
-            continue;
+static uint32_t isc_ring_recv(struct isc_device *idev)
+{
+    struct isc_ring *r = idev->recvq.ring;
+    uint32_t head, tail, n = 0;
+    struct isc_msg *m;
+    uint16_t num;
+
+    tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    if (head != tail)
+        isc_track(&idev->recvq, head - tail, head - tail);
+    while (tail != head) {
         m = (struct isc_msg *)list_get(idev->recvq.rp, NULL);
         isc_handle_msg(idev, m);
-        rc = isc_send_ack(idev->fd, m->seq);
-        if (rc < 0) {
-            LOGE("failed to call isc_send_ack (rc=%d)\n", rc);
-            continue;
-        }
         idev->recvq.rp = list_next(idev->recvq.rp);
+        __atomic_store_n(&r->tail, ++tail, __ATOMIC_RELEASE);
+        n++;
     }
-    return NULL;
+
+    if (n) {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&r->prod_wait, __ATOMIC_RELAXED))
+            isc_ring_kick(idev, ISC_BIND_K_2_U, ISC_KICK_WAKE, tail);
+
+        num = isc_resize_target(idev, &idev->recvq);
+        if (num)
+            isc_resize_queue(idev, &idev->recvq, ISC_BIND_K_2_U, num);
+    }
+    return n;
 }
 
-static int isc_create_task(struct isc_device *idev)
+/* true if the recvq head stayed at idx and the thread may poll */
+static bool isc_ring_idle(struct isc_device *idev, uint32_t idx)
 {
-    int rc;
-    int fd;
+    struct isc_ring *r = idev->recvq.ring;
+    uint32_t i;
 
-    fd = eventfd(0, 0);
-    if (fd < 0)
-        return fd;
+    for (i = 0; i < isc_spin(idev); i++) {
+        if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) != idx)
+            return false;
+        isc_cpu_relax();
+    }
 
-    idev->efd = fd;
-    idev->is_task_started = true;
-    rc = pthread_create(&idev->task_handle, NULL, isc_task_handler, idev);
-    if (rc < 0) {
-        idev->is_task_started = false;
-        close(fd);
-        return rc;
+    if (isc_ring_kick(idev, ISC_BIND_K_2_U, ISC_KICK_ARM, idx) < 0)
+        return true;
+
+    /* a producer seeing the flag also sees cons_want cleared */
+    __atomic_store_n(&r->cons_wait, 1, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) != idx) {
+        __atomic_store_n(&r->cons_wait, 0, __ATOMIC_RELAXED);
+        return false;
     }
-    return 0;
+    return true;
 }
 
-static void isc_destroy_task(struct isc_device *idev)
+static inline bool isc_moderated(const struct isc_opts *o)
 {
-    uint64_t u = 1;
-    ssize_t rn;
-
-    idev->is_task_started = false;
+    return (o->flags & ISC_OPT_MODERATE) && o->mod_usecs;
+}
 
-    rn = write(idev->efd, &u, sizeof(u));
-    (void)rn;
+/* sleep until end unless one of fds gets ready first */
+static void isc_sleep_until(struct pollfd *fds, nfds_t n, uint64_t end)
+{
+    uint64_t now = isc_clock_ns(CLOCK_MONOTONIC);
+    struct timespec ts;
 
-    pthread_join(idev->task_handle, NULL);
-    close(idev->efd);
+    if (now >= end)
+        return;
+    ts.tv_sec = (end - now) / 1000000000ull;
+    ts.tv_nsec = (end - now) % 1000000000ull;
+    ppoll(fds, n, &ts, NULL);
 }
 
-static void isc_destroy_queue(struct isc_queue *q)
+#if defined(__NR_io_uring_setup) && defined(IORING_SETUP_SQE128)
+#define ISC_HAVE_URING
+
+/* user_data of the requests of the receive ring */
+enum isc_uring_req {
+    ISC_URING_DEV = 1, /* multishot poll of the device fd */
+    ISC_URING_WAKE,    /* multishot poll of the task eventfd */
+    ISC_URING_ACK,     /* ISC_URING_CMD_RECV */
+    ISC_URING_MOD,     /* ISC_OPT_MODERATE timeout */
+};
+
+struct isc_uring {
+    int fd;
+    void *ring;
+    size_t ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    uint32_t *sq_tail, sq_mask;
+    uint32_t *cq_head, *cq_tail, cq_mask;
+    struct io_uring_cqe *cqes;
+    uint32_t queued; /* SQEs not submitted yet */
+    struct __kernel_timespec ts;
+};
+
+static void isc_uring_exit(struct isc_uring *u)
 {
-    struct list *pos, *next;
+    if (u->sqes)
+        munmap(u->sqes, u->sqes_size);
+    if (u->ring)
+        munmap(u->ring, u->ring_size);
+    close(u->fd);
+}
 
-    next = q->wp;
-    pos = q->wp;
-    while (next) {
-        next = list_del(pos);
-        free(pos);
-        pos = next;
-    }
-    q->wp = NULL;
-    q->rp = NULL;
+static bool isc_uring_probe(int fd)
+{
+    size_t sz = sizeof(struct io_uring_probe) +
+                IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *p = (struct io_uring_probe *)calloc(1, sz);
+    bool ok;
+
+    if (!p)
+        return false;
+    ok = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, p,
+                 IORING_OP_LAST) == 0 &&
+         p->last_op >= IORING_OP_URING_CMD &&
+         (p->ops[IORING_OP_POLL_ADD].flags & IO_URING_OP_SUPPORTED) &&
+         (p->ops[IORING_OP_URING_CMD].flags & IO_URING_OP_SUPPORTED);
+    free(p);
+    return ok;
 }
 
-static int isc_create_queue(struct isc_queue *q, uint16_t msz, uint16_t num,
-                            uint8_t *mem)
+/* a single mmap for both rings, as every kernel with uring_cmd does */
+static int isc_uring_init(struct isc_uring *u)
 {
-    uint32_t node_sz = msz + sizeof(struct isc_msg);
-    struct isc_msg *m;
-    struct list *pos;
-    uint16_t i = 0;
+    struct io_uring_params p;
+    size_t sq_size, cq_size;
+    uint8_t *ring;
+    uint32_t i;
+
+    memset(u, 0, sizeof(*u));
+    memset(&p, 0, sizeof(p));
+    u->fd = syscall(__NR_io_uring_setup, ISC_URING_DEPTH, &p);
+    if (u->fd < 0)
+        return -1;
+
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !isc_uring_probe(u->fd))
+        goto _fail;
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    u->ring = mmap(0, u->ring_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->ring == MAP_FAILED) {
+        u->ring = NULL;
+        goto _fail;
+    }
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = (struct io_uring_sqe *)mmap(0, u->sqes_size,
+                                          PROT_READ | PROT_WRITE,
+                                          MAP_SHARED | MAP_POPULATE, u->fd,
+                                          IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        goto _fail;
+    }
+
+    ring = (uint8_t *)u->ring;
+    u->sq_tail = (uint32_t *)(ring + p.sq_off.tail);
+    u->sq_mask = *(uint32_t *)(ring + p.sq_off.ring_mask);
+    u->cq_head = (uint32_t *)(ring + p.cq_off.head);
+    u->cq_tail = (uint32_t *)(ring + p.cq_off.tail);
+    u->cq_mask = *(uint32_t *)(ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+    for (i = 0; i < p.sq_entries; i++)
+        ((uint32_t *)(ring + p.sq_off.array))[i] = i;
+    return 0;
+
+_fail:
+    isc_uring_exit(u);
+    return -1;
+}
+
+/* never more than ISC_URING_DEPTH in flight, the SQ cannot overflow */
+static struct io_uring_sqe *isc_uring_sqe(struct isc_uring *u, uint8_t op,
+                                          int fd, uint64_t data)
+{
+    uint32_t tail = *u->sq_tail + u->queued++;
+    struct io_uring_sqe *sqe = &u->sqes[tail & u->sq_mask];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->user_data = data;
+    return sqe;
+}
+
+static void isc_uring_poll(struct isc_uring *u, int fd, uint64_t data)
+{
+    struct io_uring_sqe *sqe = isc_uring_sqe(u, IORING_OP_POLL_ADD, fd, data);
+
+    sqe->len = IORING_POLL_ADD_MULTI;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    sqe->poll32_events = POLLIN << 16;
+#else
+    sqe->poll32_events = POLLIN;
+#endif
+}
+
+static void isc_uring_ack(struct isc_uring *u, int fd, uint16_t seq,
+                          uint16_t num)
+{
+    struct io_uring_sqe *sqe = isc_uring_sqe(u, IORING_OP_URING_CMD, fd,
+                                             ISC_URING_ACK);
+    struct isc_recv *recv = (struct isc_recv *)sqe->cmd;
+
+    sqe->cmd_op = ISC_URING_CMD_RECV;
+    recv->seq = seq;
+    recv->num = num;
+}
+
+/* completes after usecs or once count other completions were posted */
+static void isc_uring_timeout(struct isc_uring *u, uint32_t usecs,
+                              uint32_t count)
+{
+    struct io_uring_sqe *sqe = isc_uring_sqe(u, IORING_OP_TIMEOUT, -1,
+                                             ISC_URING_MOD);
+
+    u->ts.tv_sec = usecs / 1000000;
+    u->ts.tv_nsec = usecs % 1000000 * 1000;
+    sqe->addr = (uint64_t)(uintptr_t)&u->ts;
+    sqe->len = 1;
+    sqe->off = count;
+}
+
+/* submit what was queued and wait for one completion, one syscall */
+static int isc_uring_enter(struct isc_uring *u)
+{
+    uint32_t n = u->queued;
+    int rc;
+
+    __atomic_store_n(u->sq_tail, *u->sq_tail + n, __ATOMIC_RELEASE);
+    u->queued = 0;
+    /* nothing was submitted if the wait got interrupted */
+    do {
+        rc = syscall(__NR_io_uring_enter, u->fd, n, 1,
+                     IORING_ENTER_GETEVENTS, NULL, 0);
+    } while (rc < 0 && errno == EINTR);
+    return rc < 0 ? -1 : 0;
+}
+
+/* result of the ack in flight, after submitting it if still queued */
+static int32_t isc_uring_wait_ack(struct isc_uring *u)
+{
+    struct io_uring_cqe *cqe;
+    uint32_t head = *u->cq_head;
+
+    for (;;) {
+        while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+            cqe = &u->cqes[head++ & u->cq_mask];
+            if (cqe->user_data != ISC_URING_ACK)
+                continue;
+            __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+            return cqe->res;
+        }
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+        if (isc_uring_enter(u) < 0)
+            return -EIO;
+    }
+}
+
+/*
+ * Receive loop of a v1 recvq on io_uring: the device fd stays polled, and
+ * the ack of a drained batch goes out with the wait for the next one. The
+ * ack tells how many messages are still queued, so a poll completion is
+ * only a hint to ask again. A moderated handle asks after a timeout that
+ * also fires once mod_msgs more poll completions arrived. Returns -1
+ * whenever the poll() loop must take over, e.g. if the driver has no
+ * uring_cmd. It only does so once the batch handed to got() last is acked
+ * and rp is past it, so no message is handled twice.
+ */
+static int isc_uring_loop(struct isc_device *idev)
+{
+    bool busy = true, recheck = false, worked = false;
+    struct list *pos, *next = NULL;
+    struct io_uring_cqe *cqe;
+    struct isc_uring u;
+    struct isc_msg *m;
+    uint16_t seq = 0;
+    uint32_t head, i, n, acking = 0;
+    int32_t res;
+    int rc = 0;
+
+    if (isc_uring_init(&u) < 0)
+        return -1;
+
+    isc_uring_poll(&u, idev->fd, ISC_URING_DEV);
+    isc_uring_poll(&u, idev->task.efd, ISC_URING_WAKE);
+    isc_uring_ack(&u, idev->fd, 0, 0);
+
+    while (idev->task.is_started && rc == 0) {
+        rc = isc_uring_enter(&u);
+        if (rc < 0)
+            break;
+
+        head = *u.cq_head;
+        while (rc == 0 &&
+               head != __atomic_load_n(u.cq_tail, __ATOMIC_ACQUIRE)) {
+            cqe = &u.cqes[head++ & u.cq_mask];
+            res = cqe->res;
+            if (cqe->user_data == ISC_URING_MOD) {
+                isc_uring_ack(&u, idev->fd, 0, 0);
+                continue;
+            }
+            if (cqe->user_data != ISC_URING_ACK) {
+                if (res < 0) {
+                    rc = -1;
+                    break;
+                }
+                if (!(cqe->flags & IORING_CQE_F_MORE))
+                    isc_uring_poll(&u,
+                                   cqe->user_data == ISC_URING_DEV
+                                       ? idev->fd
+                                       : idev->task.efd,
+                                   cqe->user_data);
+                if (cqe->user_data != ISC_URING_DEV)
+                    continue;
+                if (busy) {
+                    recheck = true;
+                    continue;
+                }
+                if (isc_moderated(&idev->opts))
+                    isc_uring_timeout(&u, idev->opts.mod_usecs,
+                                      idev->opts.mod_msgs);
+                else
+                    isc_uring_ack(&u, idev->fd, 0, 0);
+                busy = true;
+                continue;
+            }
+
+            busy = false;
+            if (res < 0) {
+                if (worked)
+                    LOGE("failed to ack with io_uring (rc=%s)\n",
+                         strerror(-res));
+                rc = -1;
+                break;
+            }
+            worked = true;
+            /* the batch in flight is acked, rp moves past it */
+            if (acking)
+                idev->recvq.rp = next;
+            acking = 0;
+
+            n = (uint32_t)res < idev->recvq.num ? res : idev->recvq.num;
+            pos = idev->recvq.rp;
+            for (i = 0; i < n; i++) {
+                m = (struct isc_msg *)list_get(pos, NULL);
+                if (!i)
+                    seq = m->seq;
+                isc_handle_msg(idev, m);
+                pos = list_next(pos);
+            }
+            next = pos;
+            acking = n;
+            if (n || recheck) {
+                isc_uring_ack(&u, idev->fd, seq, n);
+                busy = true;
+                recheck = false;
+            }
+        }
+        __atomic_store_n(u.cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    /* settle the batch got() saw, its ack may still be on the ring */
+    if (acking) {
+        res = busy ? isc_uring_wait_ack(&u) : -1;
+        if (res < 0 && isc_send_ack(idev->fd, seq, acking) < 0)
+            LOGE("lost the ack of %u messages (uid=0x%08x)\n", acking,
+                 idev->uid);
+        idev->recvq.rp = next;
+    }
+
+    isc_uring_exit(&u);
+    return rc;
+}
+#endif
+
+/*
+ * A burst just started on the recvq ring: hold it until mod_msgs are
+ * queued or mod_usecs passed. Only a producer with ISC_FEAT_WANT can wake
+ * the thread early, an older one would kick on every message.
+ */
+static void isc_ring_moderate(struct isc_device *idev, struct pollfd *fds)
+{
+    struct isc_ring *r = idev->recvq.ring;
+    uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    uint32_t want = idev->opts.mod_msgs;
+    bool kick = idev->recvq.want && want;
+    uint64_t end;
+
+    if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == tail)
+        return;
+
+    end = isc_clock_ns(CLOCK_MONOTONIC) + idev->opts.mod_usecs * 1000ull;
+    while (idev->task.is_started &&
+           (!want || __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - tail <
+                         want) &&
+           isc_clock_ns(CLOCK_MONOTONIC) < end) {
+        if (kick &&
+            isc_ring_kick(idev, ISC_BIND_K_2_U, ISC_KICK_ARM, tail) < 0)
+            kick = false;
+        if (!kick) {
+            isc_sleep_until(&fds[1], 1, end);
+            continue;
+        }
+
+        __atomic_store_n(&r->cons_want, tail + want, __ATOMIC_RELAXED);
+        __atomic_store_n(&r->cons_wait, 1, __ATOMIC_RELEASE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - tail < want)
+            isc_sleep_until(fds, 2, end);
+        __atomic_store_n(&r->cons_wait, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&r->cons_want, 0, __ATOMIC_RELAXED);
+    }
+}
+
+static void isc_wake_task(struct isc_task *t);
+
+static inline struct isc_msg *isc_pull_msg(struct isc_device *idev,
+                                           uint32_t idx)
+{
+    struct isc_queue *q = &idev->recvq;
+
+    if (!q->ring)
+        return idev->pull.msg;
+    return (struct isc_msg *)((uint8_t *)q->mem +
+                              (idx % q->num) * isc_slot_size(q->msz, q->ts));
+}
+
+static inline uint32_t isc_pull_head(struct isc_device *idev)
+{
+    struct isc_ring *r = idev->recvq.ring;
+
+    return __atomic_load_n(r ? &r->head : &idev->pull.head, __ATOMIC_ACQUIRE);
+}
+
+static inline uint32_t *isc_pull_tail(struct isc_device *idev)
+{
+    struct isc_ring *r = idev->recvq.ring;
+
+    return r ? &r->tail : &idev->pull.tail;
+}
+
+/* claim the oldest slot nobody claimed yet, false if there is none */
+static bool isc_pull_claim(struct isc_device *idev, uint32_t *idx)
+{
+    uint32_t n = __atomic_load_n(&idev->pull.next, __ATOMIC_RELAXED);
+
+    do {
+        if (n == isc_pull_head(idev))
+            return false;
+    } while (!__atomic_compare_exchange_n(&idev->pull.next, &n, n + 1, true,
+                                          __ATOMIC_ACQUIRE,
+                                          __ATOMIC_RELAXED));
+    *idx = n;
+    return true;
+}
+
+/*
+ * Slot idx is done. The thread that finds the oldest slot released takes
+ * it off the done list and moves the tail on, so slots go back to the
+ * driver in order whichever thread released them last.
+ */
+static void isc_pull_retire(struct isc_device *idev, uint32_t idx)
+{
+    struct isc_ring *r = idev->recvq.ring;
+    uint32_t *tail = isc_pull_tail(idev);
+    uint64_t *done = idev->pull.done;
+    uint32_t num = idev->recvq.num;
+    uint64_t want;
+    uint32_t t;
+
+    __atomic_store_n(&done[idx % num], (uint64_t)idx + 1, __ATOMIC_SEQ_CST);
+    for (;;) {
+        t = __atomic_load_n(tail, __ATOMIC_SEQ_CST);
+        want = (uint64_t)t + 1;
+        if (!__atomic_compare_exchange_n(&done[t % num], &want, 0, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+            break;
+
+        if (!r)
+            isc_send_ack(idev->fd, isc_pull_msg(idev, t)->seq, 1);
+        __atomic_store_n(tail, t + 1, __ATOMIC_SEQ_CST);
+        if (!r)
+            isc_wake_task(&idev->task);
+        else if (__atomic_load_n(&r->prod_wait, __ATOMIC_SEQ_CST))
+            isc_ring_kick(idev, ISC_BIND_K_2_U, ISC_KICK_WAKE, t + 1);
+    }
+}
+
+/* stamp, account and retire a slot whose reply is in place */
+static void isc_pull_done(struct isc_device *idev, uint32_t idx,
+                          struct isc_msg *m)
+{
+    struct isc_msg_ts *ts = isc_msg_ts(m);
+
+    if (ts) {
+        ts->done = isc_clock_ns(CLOCK_MONOTONIC);
+        isc_account_recv(idev, ts);
+    }
+    isc_pull_retire(idev, idx);
+}
+
+/* a claimed slot: false if it was no user message and is done already */
+static bool isc_pull_take(struct isc_device *idev, uint32_t idx,
+                          struct isc_slot *slot)
+{
+    struct isc_msg *m = isc_pull_msg(idev, idx);
+    struct isc_msg_ts *ts = isc_msg_ts(m);
+    struct isc_buf_desc *desc;
+    uint32_t len = m->len;
+    void *data;
+
+    if (ts)
+        ts->pickup = isc_clock_ns(CLOCK_MONOTONIC);
+    isc_capture(idev, ISC_CAP_RECV, m, isc_msg_data(m));
+    if (!(m->flags & ISC_MSG_FLAG_USER)) {
+        isc_handle_int_msg(idev, m);
+        isc_pull_done(idev, idx, m);
+        return false;
+    }
+
+    data = isc_msg_data(m);
+    if (m->flags & ISC_MSG_FLAG_BUF) {
+        desc = (struct isc_buf_desc *)data;
+        data = len >= sizeof(*desc) ? isc_buf_data(idev, desc) : NULL;
+        if (!data) {
+            LOGE("bad buffer descriptor (uid=0x%08x)\n", idev->uid);
+            m->rc = -1;
+            isc_pull_done(idev, idx, m);
+            return false;
+        }
+        len = desc->len;
+    }
+
+    slot->data = data;
+    slot->len = len;
+    slot->idx = idx;
+    return true;
+}
+
+static void isc_pull_publish(struct isc_device *idev)
+{
+    __atomic_add_fetch(&idev->pull.gen, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&idev->pull.waiters, __ATOMIC_SEQ_CST))
+        syscall(SYS_futex, &idev->pull.gen, FUTEX_WAKE_PRIVATE, INT_MAX,
+                NULL, NULL, 0);
+}
+
+/* link events at the front of a v2 ring, bound() may come before recv() */
+static void isc_pull_link(struct isc_device *idev)
+{
+    uint32_t n = __atomic_load_n(&idev->pull.next, __ATOMIC_RELAXED);
+    struct isc_msg *m;
+
+    while (n != isc_pull_head(idev)) {
+        m = isc_pull_msg(idev, n);
+        if (m->flags & ISC_MSG_FLAG_USER)
+            return;
+        if (!__atomic_compare_exchange_n(&idev->pull.next, &n, n + 1, false,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            continue;
+        isc_handle_msg(idev, m);
+        isc_pull_retire(idev, n++);
+    }
+}
+
+/*
+ * ISC_OPT_PULL receive thread: it only publishes what the driver queued
+ * and wakes the threads in recv(). A v1 queue shows its depth to the
+ * driver only, so there it hands out one slot at a time.
+ */
+static void isc_pull_loop(struct isc_device *idev, struct pollfd *fds)
+{
+    struct isc_pull *p = &idev->pull;
+    struct isc_ring *r = idev->recvq.ring;
+    struct isc_msg *m;
+    uint32_t head;
+    uint64_t u;
+    bool busy;
+    int rc;
+
+    while (idev->task.is_started) {
+        if (r) {
+            head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+            if (head != p->seen) {
+                isc_track(&idev->recvq,
+                          head - __atomic_load_n(&r->tail, __ATOMIC_RELAXED),
+                          0);
+                p->seen = head;
+                isc_pull_link(idev);
+                isc_pull_publish(idev);
+                continue;
+            }
+            if (isc_ring_idle(idev, head))
+                poll(fds, 2, -1);
+            __atomic_store_n(&r->cons_wait, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        /* the efd is rung by the release of the slot that is out */
+        busy = __atomic_load_n(&p->tail, __ATOMIC_ACQUIRE) != p->head;
+        fds[0].revents = 0;
+        fds[1].revents = 0;
+        rc = poll(busy ? &fds[1] : fds, busy ? 1 : 2, -1);
+        if (rc <= 0)
+            continue;
+        if ((fds[1].revents & POLLIN) &&
+            read(fds[1].fd, &u, sizeof(u)) != sizeof(u))
+            continue;
+        if (busy || !(fds[0].revents & POLLIN))
+            continue;
+
+        m = (struct isc_msg *)list_get(idev->recvq.rp, NULL);
+        idev->recvq.rp = list_next(idev->recvq.rp);
+        if (!(m->flags & ISC_MSG_FLAG_USER)) {
+            isc_handle_msg(idev, m);
+            isc_send_ack(idev->fd, m->seq, 1);
+            continue;
+        }
+        p->msg = m;
+        __atomic_store_n(&p->head, p->head + 1, __ATOMIC_RELEASE);
+        isc_pull_publish(idev);
+    }
+}
+
+static void *isc_task_handler(void *arg)
+{
+    struct isc_device *idev = (struct isc_device *)arg;
+    bool mod, burst = false;
+    struct pollfd fds[2];
+    struct isc_msg *m;
+    uint32_t n, tail;
+    int rc;
+
+    if (!idev)
+        return NULL;
+    mod = isc_moderated(&idev->opts);
+
+#ifdef ISC_HAVE_URING
+    if ((idev->opts.flags & ISC_OPT_URING) && !idev->recvq.ring &&
+        !idev->pull.done)
+        isc_uring_loop(idev);
+#endif
+
+    memset(fds, 0, sizeof(fds));
+    fds[0].fd = idev->fd;
+    fds[1].fd = idev->task.efd;
+    fds[0].events = POLLIN;
+    fds[1].events = POLLIN;
+
+    if (idev->pull.done) {
+        isc_pull_loop(idev, fds);
+        return NULL;
+    }
+
+    while (idev->task.is_started) {
+        if (idev->recvq.ring) {
+            if (mod && !burst)
+                isc_ring_moderate(idev, fds);
+            n = isc_ring_recv(idev);
+            burst = n;
+            if (n)
+                continue;
+            tail = __atomic_load_n(&idev->recvq.ring->tail, __ATOMIC_RELAXED);
+            if (!isc_ring_idle(idev, tail))
+                continue;
+        }
+
+        /* a v1 burst is drained without blocking, then moderated again */
+        fds[0].revents = 0;
+        rc = poll(fds, ARRAY_SIZE(fds), burst ? 0 : -1);
+        if (idev->recvq.ring) {
+            __atomic_store_n(&idev->recvq.ring->cons_wait, 0,
+                             __ATOMIC_RELAXED);
+            continue;
+        }
+        if (rc == 0)
+            burst = false;
+        if (rc <= 0)
+            continue;
+        if (!(fds[0].revents & POLLIN))
+            continue;
+        if (mod && !burst) {
+            isc_sleep_until(&fds[1], 1,
+                            isc_clock_ns(CLOCK_MONOTONIC) +
+                                idev->opts.mod_usecs * 1000ull);
+            burst = true;
+        }
+        m = (struct isc_msg *)list_get(idev->recvq.rp, NULL);
+        isc_handle_msg(idev, m);
+        rc = isc_send_ack(idev->fd, m->seq, 1);
+        if (rc < 0) {
+            LOGE("failed to call isc_send_ack (rc=%d)\n", rc);
+            continue;
+        }
+        idev->recvq.rp = list_next(idev->recvq.rp);
+    }
+    return NULL;
+}
+
+static int isc_init_task_attr(pthread_attr_t *attr, const struct isc_opts *o)
+{
+    struct sched_param param;
+    cpu_set_t cpus;
+    uint32_t i;
+    int rc = 0;
+
+    if (o->stack_size)
+        rc |= pthread_attr_setstacksize(attr, o->stack_size);
+
+    if (o->policy != SCHED_OTHER) {
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = o->priority;
+        rc |= pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED);
+        rc |= pthread_attr_setschedpolicy(attr, o->policy);
+        rc |= pthread_attr_setschedparam(attr, &param);
+    }
+
+    if (o->cpus && o->ncpus) {
+        CPU_ZERO(&cpus);
+        for (i = 0; i < o->ncpus; i++)
+            if (o->cpus[i] >= 0 && o->cpus[i] < CPU_SETSIZE)
+                CPU_SET(o->cpus[i], &cpus);
+        rc |= pthread_attr_setaffinity_np(attr, sizeof(cpus), &cpus);
+    }
+    return rc ? -1 : 0;
+}
+
+static int isc_create_task(struct isc_task *t, void *(*fn)(void *), void *arg,
+                           const struct isc_opts *o)
+{
+    pthread_attr_t attr;
+    int rc;
+    int fd;
+
+    fd = eventfd(0, 0);
+    if (fd < 0)
+        return fd;
+
+    pthread_attr_init(&attr);
+    if (isc_init_task_attr(&attr, o) < 0) {
+        LOGE("invalid receive thread attributes\n");
+        pthread_attr_destroy(&attr);
+        close(fd);
+        return -1;
+    }
+
+    t->efd = fd;
+    t->is_started = true;
+    rc = pthread_create(&t->handle, &attr, fn, arg);
+    pthread_attr_destroy(&attr);
+    if (rc) {
+        /* EPERM here usually means no CAP_SYS_NICE for a RT policy */
+        LOGE("failed to create receive thread (rc=%s)\n", strerror(rc));
+        t->is_started = false;
+        close(fd);
+        return -1;
+    }
+    return 0;
+}
+
+static void isc_wake_task(struct isc_task *t)
+{
+    uint64_t u = 1;
+    ssize_t rn;
+
+    rn = write(t->efd, &u, sizeof(u));
+    (void)rn;
+}
+
+static void isc_destroy_task(struct isc_task *t)
+{
+    t->is_started = false;
+    isc_wake_task(t);
+
+    pthread_join(t->handle, NULL);
+    close(t->efd);
+}
+
+static void isc_destroy_queue(struct isc_queue *q)
+{
+    struct list *pos, *next;
+
+    next = q->wp;
+    pos = q->wp;
+    while (next) {
+        next = list_del(pos);
+        free(pos);
+        pos = next;
+    }
+    q->wp = NULL;
+    q->rp = NULL;
+}
+
+static int isc_create_queue(struct isc_queue *q, uint16_t msz, uint16_t num,
+                            uint8_t *mem)
+{
+    uint32_t node_sz = isc_slot_size(msz, q->ts);
+    struct isc_msg *m;
+    struct list *pos;
+    uint16_t i = 0;
 
     while (i < num) {
         pos = (struct list *)calloc(1, sizeof(struct list));
@@ -277,93 +1518,759 @@ static int isc_create_queue(struct isc_queue *q, uint16_t msz, uint16_t num,
         }
         i++;
     }
+    q->msz = msz;
+    q->num = num;
+    q->stat.num = num;
     return 0;
 }
 
-static void isc_close(struct isc_handle *isc)
+static void isc_chan_close(struct isc_device *idev)
 {
-    struct isc_device *idev = (struct isc_device *)isc;
-    int rc, noarg = 0;
+    struct isc_sess *sess = idev->sess;
+    struct isc_chan_xfer x;
+    int rc;
 
-    if (!idev)
-        return;
+    if (idev->ch < ISC_SESSION_MAX) {
+        pthread_mutex_lock(&sess->lock);
+        if (sess->chans[idev->ch] == idev)
+            sess->chans[idev->ch] = NULL;
+        pthread_mutex_unlock(&sess->lock);
+
+        memset(&x, 0, sizeof(x));
+        x.ch = idev->ch;
+        rc = isc_dev->ioctl(sess->fd, ISC_IOCTL_CH_CLOSE, &x);
+        if (rc < 0)
+            LOGE("failed to ioctl ISC_IOCTL_CH_CLOSE (rc=%s)\n",
+                 strerror(errno));
+    }
 
-    isc_destroy_task(idev);
+    /* queue memory belongs to the session mapping */
+    if (idev->sendq.mem)
+        isc_destroy_queue(&idev->sendq);
+    if (idev->recvq.mem)
+        isc_destroy_queue(&idev->recvq);
 
+    pthread_mutex_destroy(&idev->send_lock);
+    free(idev->held);
+    free(idev->failed);
+    free(idev);
+}
+
+/* the mappings keep the file and so the bind alive, drop them all */
+static void isc_unmap(struct isc_device *idev)
+{
     if (idev->sendq.mem) {
         isc_destroy_queue(&idev->sendq);
-        munmap(idev->sendq.mem, idev->sendq.size);
+        isc_dev->munmap(idev->sendq.mem, idev->sendq.size);
     }
     if (idev->recvq.mem) {
         isc_destroy_queue(&idev->recvq);
-        munmap(idev->recvq.mem, idev->recvq.size);
+        isc_dev->munmap(idev->recvq.mem, idev->recvq.size);
+    }
+    if (idev->buf)
+        isc_dev->munmap(idev->buf, idev->buf_size);
+    if (idev->pull.done) {
+        free(idev->pull.done);
+        pthread_mutex_destroy(&idev->pull.lock);
+    }
+}
+
+static void isc_close(struct isc_handle *isc)
+{
+    struct isc_device *idev = (struct isc_device *)isc;
+    int rc, noarg = 0;
+
+    if (!idev)
+        return;
+
+    if (idev->sess) {
+        isc_chan_close(idev);
+        return;
     }
 
-    rc = ioctl(idev->fd, ISC_IOCTL_CLOSE, &noarg);
+    isc_destroy_task(&idev->task);
+    isc_unmap(idev);
+
+    rc = isc_dev->ioctl(idev->fd, ISC_IOCTL_CLOSE, &noarg);
     if (rc < 0)
         LOGE("failed to ioctl ISC_IOCTL_CLOSE (rc=%s)\n", strerror(errno));
 
     pthread_mutex_destroy(&idev->send_lock);
-    close(idev->fd);
+    isc_dev->close(idev->fd);
+    free(idev->held);
+    free(idev->failed);
     free(idev);
 }
 
-static int isc_send_msg(struct isc_handle *isc, void *msg, uint32_t len,
-                        int32_t *result)
+static int isc_kick_send(struct isc_device *idev, uint16_t seq, uint16_t num)
+{
+    struct isc_chan_xfer x;
+    struct isc_send send;
+    int rc;
+
+    if (idev->sess) {
+        memset(&x, 0, sizeof(x));
+        x.ch = idev->ch;
+        x.seq = seq;
+        x.num = num;
+        rc = isc_dev->ioctl(idev->fd, ISC_IOCTL_CH_SEND, &x);
+        if (rc < 0)
+            LOGE("failed to ioctl ISC_IOCTL_CH_SEND (rc=%s)\n",
+                 strerror(errno));
+        return rc;
+    }
+
+    memset(&send, 0, sizeof(send));
+    send.num = num;
+    send.seq = seq;
+    rc = isc_dev->ioctl(idev->fd, ISC_IOCTL_SEND, &send);
+    if (rc < 0)
+        LOGE("failed to ioctl ISC_IOCTL_SEND (rc=%s)\n", strerror(errno));
+    return rc;
+}
+
+/* wait until the driver has consumed the sendq up to end */
+static int isc_ring_wait(struct isc_device *idev, uint32_t end)
+{
+    struct isc_ring *r = idev->sendq.ring;
+    uint32_t i;
+    int rc = 0;
+
+    for (i = 0; i < isc_spin(idev); i++) {
+        if ((int32_t)(__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) - end) >= 0)
+            return 0;
+        isc_cpu_relax();
+    }
+
+    __atomic_store_n(&r->prod_wait, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    while ((int32_t)(__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) - end) < 0) {
+        rc = isc_ring_kick(idev, ISC_BIND_U_2_K, ISC_KICK_WAIT, end);
+        if (rc < 0)
+            break;
+    }
+    __atomic_store_n(&r->prod_wait, 0, __ATOMIC_RELAXED);
+    return rc;
+}
+
+/* release the sendq slots the driver has consumed up to tail */
+static void isc_ring_reap(struct isc_device *idev)
+{
+    struct isc_queue *q = &idev->sendq;
+    uint32_t tail = __atomic_load_n(&q->ring->tail, __ATOMIC_ACQUIRE);
+    struct isc_msg *m;
+
+    while (q->done != tail) {
+        m = (struct isc_msg *)list_get(q->rp, NULL);
+        if ((m->flags & ISC_MSG_FLAG_ONEWAY) && m->rc)
+            isc_oneway_failed(idev, isc_msg_data(m), m->len, m->rc);
+        isc_account(&q->delay, isc_msg_ts(m));
+        q->rp = list_next(q->rp);
+        q->done++;
+    }
+}
+
+/* make sure the slot at wp is free, one-way sends may still hold it */
+static int isc_ring_reserve(struct isc_device *idev)
+{
+    struct isc_queue *q = &idev->sendq;
+    uint32_t head = __atomic_load_n(&q->ring->head, __ATOMIC_RELAXED);
+    int rc;
+
+    if (head - q->done < q->num)
+        return 0;
+
+    isc_ring_reap(idev);
+    if (head - q->done < q->num)
+        return 0;
+
+    rc = isc_ring_wait(idev, head - q->num + 1);
+    if (rc < 0)
+        return rc;
+    isc_ring_reap(idev);
+    return 0;
+}
+
+static int isc_ring_send(struct isc_device *idev, bool oneway)
+{
+    struct isc_ring *r = idev->sendq.ring;
+    uint32_t head = __atomic_load_n(&r->head, __ATOMIC_RELAXED) + 1;
+    int rc;
+
+    __atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+    idev->sendq.wp = list_next(idev->sendq.wp);
+    idev->seq++;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->cons_wait, __ATOMIC_RELAXED)) {
+        rc = isc_ring_kick(idev, ISC_BIND_U_2_K, ISC_KICK_WAKE, head);
+        if (rc < 0)
+            return rc;
+    }
+    if (oneway)
+        return 0;
+
+    rc = isc_ring_wait(idev, head);
+    if (rc < 0)
+        return rc;
+    isc_ring_reap(idev);
+    return 0;
+}
+
+/* send_lock held, waits for every slot in flight before rebinding */
+static void isc_resize_sendq(struct isc_device *idev)
+{
+    uint16_t num = isc_resize_target(idev, &idev->sendq);
+    uint32_t head;
+
+    if (!num)
+        return;
+
+    head = __atomic_load_n(&idev->sendq.ring->head, __ATOMIC_RELAXED);
+    if (isc_ring_wait(idev, head) < 0)
+        return;
+    isc_ring_reap(idev);
+    isc_resize_queue(idev, &idev->sendq, ISC_BIND_U_2_K, num);
+}
+
+/*
+ * A one-way message neither waits for nor copies back the reply. On a v2
+ * ring the sender only waits for a free slot, a failure is reported once
+ * the slot is reaped. A v1 kick still blocks until the driver took the
+ * message, only the copy is saved. A driver may return before it writes
+ * rc, so only the kick failing counts as a failure.
+ */
+static int isc_send_locked(struct isc_device *idev, void *msg, uint32_t len,
+                           int32_t *result, uint32_t flags)
+{
+    bool oneway = flags & ISC_MSG_FLAG_ONEWAY;
+    struct isc_msg_ts *ts;
+    struct isc_ring *r;
+    struct isc_msg *m;
+    uint32_t sz;
+    int rc;
+
+    if (idev->sendq.ring) {
+        isc_resize_sendq(idev);
+        rc = isc_ring_reserve(idev);
+        if (rc < 0)
+            return rc;
+        /* unconsumed slots, one-way ones that are only unreaped don't count */
+        r = idev->sendq.ring;
+        isc_track(&idev->sendq,
+                  __atomic_load_n(&r->head, __ATOMIC_RELAXED) -
+                      __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) + 1,
+                  1);
+    } else {
+        isc_track(&idev->sendq, 1, 1);
+    }
+
+    m = (struct isc_msg *)list_get(idev->sendq.wp, &sz);
+    if (sz < len)
+        return -1;
+
+    m->seq = idev->seq;
+    m->len = len;
+    m->flags &= ~(ISC_MSG_FLAG_USER | ISC_MSG_FLAG_ONEWAY | ISC_MSG_FLAG_TS |
+                  ISC_MSG_FLAG_BUF);
+    m->flags |= ISC_MSG_FLAG_USER | flags;
+    if (idev->sendq.ts) {
+        m->flags |= ISC_MSG_FLAG_TS;
+        ts = isc_msg_ts(m);
+        ts->pickup = 0;
+        ts->done = 0;
+        ts->enq = isc_clock_ns(CLOCK_MONOTONIC);
+    }
+    if (len >= isc_nt_min(idev))
+        isc_copy_nt(isc_msg_data(m), msg, len);
+    else
+        memcpy(isc_msg_data(m), msg, len);
+    isc_capture(idev, ISC_CAP_SEND, m, msg);
+
+    if (idev->sendq.ring) {
+        rc = isc_ring_send(idev, oneway);
+    } else {
+        rc = isc_kick_send(idev, idev->seq, 1);
+        if (rc < 0)
+            return rc;
+        isc_account(&idev->sendq.delay, isc_msg_ts(m));
+        idev->sendq.wp = list_next(idev->sendq.wp);
+        idev->sendq.rp = list_next(idev->sendq.rp);
+        idev->seq++;
+    }
+    if (rc < 0 || oneway)
+        return rc;
+
+    *result = m->rc;
+    if (!m->rc)
+        memcpy(msg, isc_msg_data(m), len);
+    return rc;
+}
+
+static inline uint32_t isc_held_size(struct isc_device *idev)
+{
+    return (sizeof(struct isc_held) + idev->sendq.msz + 7) & ~7u;
+}
+
+static inline struct isc_held *isc_held_at(struct isc_device *idev,
+                                           uint32_t i)
+{
+    return (struct isc_held *)(idev->held +
+                               (uint64_t)(i % idev->opts.backlog) *
+                                   isc_held_size(idev));
+}
+
+/* send_lock held and the peer away, keep a one-way send for later */
+static int isc_hold(struct isc_device *idev, const void *msg, uint32_t len,
+                    uint32_t flags)
+{
+    struct isc_held *h;
+
+    if (!idev->held || idev->held_cnt == idev->opts.backlog ||
+        len > idev->sendq.msz)
+        return -1;
+
+    h = isc_held_at(idev, idev->held_first + idev->held_cnt++);
+    h->len = len;
+    h->flags = flags;
+    memcpy(h->d, msg, len);
+    return 0;
+}
+
+/*
+ * send_lock held and the peer back, what was held goes out first. Only a
+ * sending thread flushes: the receive thread may be what a full ring or a
+ * v1 kick waits for.
+ */
+static void isc_flush_held(struct isc_device *idev)
+{
+    struct isc_held *h;
+    int rc;
+
+    while (idev->held_cnt) {
+        h = isc_held_at(idev, idev->held_first);
+        rc = isc_send_locked(idev, h->d, h->len, NULL, h->flags);
+        if (rc < 0)
+            isc_oneway_failed(idev, h->d, h->len, rc);
+        idev->held_first = (idev->held_first + 1) % idev->opts.backlog;
+        idev->held_cnt--;
+    }
+}
+
+static int isc_alloc_held(struct isc_device *idev)
+{
+    if (!(idev->opts.flags & ISC_OPT_REBIND) || !idev->opts.backlog ||
+        !(idev->direct & ISC_DIR_SEND))
+        return 0;
+
+    idev->held = (uint8_t *)malloc((uint64_t)idev->opts.backlog *
+                                   isc_held_size(idev));
+    return idev->held ? 0 : -1;
+}
+
+static int isc_do_send(struct isc_device *idev, void *msg, uint32_t len,
+                       int32_t *result, uint32_t flags)
+{
+    int rc = -1;
+
+    if (!idev || !msg || !len)
+        return -1;
+
+    if (!(idev->direct & ISC_DIR_SEND))
+        return -1;
+
+    pthread_mutex_lock(&idev->send_lock);
+    if (idev->send_ready && idev->held_cnt)
+        isc_flush_held(idev);
+    if (idev->send_ready)
+        rc = isc_send_locked(idev, msg, len, result, flags);
+    else if (flags & ISC_MSG_FLAG_ONEWAY)
+        rc = isc_hold(idev, msg, len, flags);
+    isc_unlock_send(idev);
+    return rc;
+}
+
+static int isc_send_msg(struct isc_handle *isc, void *msg, uint32_t len,
+                        int32_t *result)
+{
+    struct isc_device *idev = (struct isc_device *)isc;
+    bool oneway;
+
+    if (!idev || !result)
+        return -1;
+
+    oneway = idev->opts.flags & ISC_OPT_ONEWAY;
+    if (oneway)
+        *result = 0;
+    return isc_do_send(idev, msg, len, result,
+                       oneway ? ISC_MSG_FLAG_ONEWAY : 0);
+}
+
+static int isc_send_oneway(struct isc_handle *isc, const void *msg,
+                           uint32_t len)
+{
+    /* a one-way send never writes to msg */
+    return isc_do_send((struct isc_device *)isc, (void *)msg, len, NULL,
+                       ISC_MSG_FLAG_ONEWAY);
+}
+
+static void *isc_buf_alloc(struct isc_handle *isc, uint32_t *id)
+{
+    struct isc_device *idev = (struct isc_device *)isc;
+
+    if (!idev || !idev->buf || !id || !isc_buf_pop(idev->buf, id))
+        return NULL;
+    return isc_buf_at(idev->buf, *id);
+}
+
+static void isc_buf_free(struct isc_handle *isc, uint32_t id)
+{
+    struct isc_device *idev = (struct isc_device *)isc;
+
+    if (idev && idev->buf && id < idev->buf->num)
+        isc_buf_push(idev->buf, id);
+}
+
+static int isc_send_buf(struct isc_handle *isc, uint32_t id, uint32_t off,
+                        uint32_t len, int32_t *result)
+{
+    struct isc_device *idev = (struct isc_device *)isc;
+    uint32_t flags = ISC_MSG_FLAG_BUF;
+    struct isc_buf_desc desc;
+
+    if (!idev)
+        return -1;
+
+    memset(&desc, 0, sizeof(desc));
+    desc.id = id;
+    desc.off = off;
+    desc.len = len;
+    if (!isc_buf_data(idev, &desc))
+        return -1;
+
+    if (!result || (idev->opts.flags & ISC_OPT_ONEWAY)) {
+        flags |= ISC_MSG_FLAG_ONEWAY;
+        if (result)
+            *result = 0;
+    }
+    return isc_do_send(idev, &desc, sizeof(desc), result, flags);
+}
+
+static int isc_recv_many(struct isc_handle *isc, struct isc_slot *slots,
+                         uint32_t n, int timeout_ms)
+{
+    struct isc_device *idev = (struct isc_device *)isc;
+    uint32_t got = 0, gen, idx;
+    struct timespec ts, *tp;
+    uint64_t end = 0, now;
+
+    if (!idev || !idev->pull.done || !slots)
+        return -1;
+
+    if (timeout_ms > 0)
+        end = isc_clock_ns(CLOCK_MONOTONIC) + timeout_ms * 1000000ull;
+
+    for (;;) {
+        /* a publish after this load fails the futex wait */
+        gen = __atomic_load_n(&idev->pull.gen, __ATOMIC_SEQ_CST);
+        while (got < n && isc_pull_claim(idev, &idx))
+            if (isc_pull_take(idev, idx, &slots[got]))
+                got++;
+        if (got || !n || !timeout_ms)
+            return got;
+
+        tp = NULL;
+        if (timeout_ms > 0) {
+            now = isc_clock_ns(CLOCK_MONOTONIC);
+            if (now >= end)
+                return 0;
+            ts.tv_sec = (end - now) / 1000000000ull;
+            ts.tv_nsec = (end - now) % 1000000000ull;
+            tp = &ts;
+        }
+        __atomic_add_fetch(&idev->pull.waiters, 1, __ATOMIC_SEQ_CST);
+        syscall(SYS_futex, &idev->pull.gen, FUTEX_WAIT_PRIVATE, gen, tp,
+                NULL, 0);
+        __atomic_sub_fetch(&idev->pull.waiters, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+static int isc_recv(struct isc_handle *isc, struct isc_slot *slot,
+                    int timeout_ms)
+{
+    return isc_recv_many(isc, slot, 1, timeout_ms);
+}
+
+static int isc_release(struct isc_handle *isc, const struct isc_slot *slot,
+                       int32_t rc)
+{
+    struct isc_device *idev = (struct isc_device *)isc;
+    struct isc_buf_desc *desc;
+    struct isc_msg *m;
+    uint32_t tail;
+
+    if (!idev || !idev->pull.done || !slot)
+        return -1;
+
+    /* only a slot that is claimed and not released yet */
+    tail = __atomic_load_n(isc_pull_tail(idev), __ATOMIC_ACQUIRE);
+    if (slot->idx - tail >=
+            __atomic_load_n(&idev->pull.next, __ATOMIC_ACQUIRE) - tail ||
+        __atomic_load_n(&idev->pull.done[slot->idx % idev->recvq.num],
+                        __ATOMIC_RELAXED) == (uint64_t)slot->idx + 1)
+        return -1;
+
+    m = isc_pull_msg(idev, slot->idx);
+    m->rc = rc;
+    if (m->flags & ISC_MSG_FLAG_BUF) {
+        desc = (struct isc_buf_desc *)isc_msg_data(m);
+        isc_buf_push(idev->buf, desc->id);
+    }
+    isc_pull_done(idev, slot->idx, m);
+    return 0;
+}
+
+static int isc_delay_stat(struct isc_handle *isc, struct isc_delay_stat *send,
+                          struct isc_delay_stat *recv)
+{
+    struct isc_device *idev = (struct isc_device *)isc;
+
+    if (!idev)
+        return -1;
+
+    if (send) {
+        pthread_mutex_lock(&idev->send_lock);
+        *send = idev->sendq.delay;
+        pthread_mutex_unlock(&idev->send_lock);
+    }
+    if (recv && idev->pull.done) {
+        pthread_mutex_lock(&idev->pull.lock);
+        *recv = idev->recvq.delay;
+        pthread_mutex_unlock(&idev->pull.lock);
+    } else if (recv) {
+        *recv = idev->recvq.delay;
+    }
+    return 0;
+}
+
+int isc_msg_time(const void *msg, uint64_t *enq_ns, uint64_t *pickup_ns)
+{
+    struct isc_msg *m = isc_cur_msg;
+    struct isc_msg_ts *ts;
+
+    if (!m || msg != isc_cur_data)
+        return -1;
+
+    ts = isc_msg_ts(m);
+    if (!ts || !ts->enq)
+        return -1;
+
+    if (enq_ns)
+        *enq_ns = ts->enq;
+    if (pickup_ns)
+        *pickup_ns = ts->pickup;
+    return 0;
+}
+
+static int isc_queue_stat(struct isc_handle *isc, struct isc_queue_stat *send,
+                          struct isc_queue_stat *recv)
+{
+    struct isc_device *idev = (struct isc_device *)isc;
+
+    if (!idev)
+        return -1;
+
+    if (send) {
+        pthread_mutex_lock(&idev->send_lock);
+        *send = idev->sendq.stat;
+        pthread_mutex_unlock(&idev->send_lock);
+    }
+    /* updated by the receive thread only, a snapshot is good enough */
+    if (recv)
+        *recv = idev->recvq.stat;
+    return 0;
+}
+
+static uint64_t isc_oneway_errors(struct isc_handle *isc)
+{
+    struct isc_device *idev = (struct isc_device *)isc;
+    uint64_t n;
+
+    if (!idev)
+        return 0;
+
+    pthread_mutex_lock(&idev->send_lock);
+    if (idev->sendq.ring)
+        isc_ring_reap(idev);
+    n = idev->oneway_errors;
+    isc_unlock_send(idev);
+    return n;
+}
+
+static int isc_chan_bind(struct isc_device *idev, struct isc_bind2 *bind,
+                         struct isc_queue *q)
+{
+    struct isc_sess *sess = idev->sess;
+    struct isc_chan_bind cb;
+    int rc;
+
+    memset(&cb, 0, sizeof(cb));
+    cb.b = *bind;
+    rc = isc_dev->ioctl(sess->fd, ISC_IOCTL_CH_BIND, &cb);
+    if (rc < 0) {
+        LOGE("failed to ioctl ISC_IOCTL_CH_BIND (rc=%s)\n", strerror(errno));
+        return rc;
+    }
+
+    if (cb.ch >= ISC_SESSION_MAX || cb.b.mem + cb.b.size > sess->size)
+        return -1;
+
+    *bind = cb.b;
+    idev->ch = cb.ch;
+    q->mem = sess->mem + cb.b.mem;
+    q->size = cb.b.size;
+    return 0;
+}
+
+/*
+ * Fallback for drivers that did not allocate on the node asked for. mbind()
+ * only places anonymous pages, as the stand-in driver hands out; pages a
+ * driver allocated itself stay where they are and the call fails.
+ */
+static void isc_place_mem(void *mem, uint32_t size, const struct isc_opts *o)
+{
+    unsigned long mask[ISC_MAX_NUMA_NODES / (8 * sizeof(unsigned long))];
+    unsigned long bits = 8 * sizeof(*mask);
+    int node = isc_mem_node(o);
+    long rc;
+
+    if (node < 0)
+        return;
+
+    memset(mask, 0, sizeof(mask));
+    mask[node / bits] = 1ul << (node % bits);
+    rc = syscall(SYS_mbind, mem, size, MPOL_BIND, mask, node + 2,
+                 MPOL_MF_MOVE);
+    if (rc < 0)
+        LOGE("failed to bind queue memory to node %d (rc=%s)\n", node,
+             strerror(errno));
+}
+
+static int isc_map_queue(struct isc_device *idev, struct isc_bind2 *bind,
+                         struct isc_queue *q);
+
+static int isc_bind_v1(struct isc_device *idev, struct isc_bind2 *bind)
+{
+    struct isc_bind b;
+    int rc;
+
+    memset(&b, 0, sizeof(b));
+    b.uid = bind->uid;
+    b.msz = bind->msz;
+    b.num = bind->num;
+    b.dir = bind->dir;
+    rc = isc_dev->ioctl(idev->fd, ISC_IOCTL_BIND, &b);
+    if (rc < 0)
+        return rc;
+
+    bind->stat = b.stat;
+    bind->size = b.size;
+    bind->mem = b.mem;
+    bind->ver = ISC_PROTO_V1;
+    bind->feat = 0;
+    return 0;
+}
+
+static int isc_map_bind(struct isc_device *idev, struct isc_bind2 *bind,
+                        struct isc_queue *q)
 {
-    struct isc_device *idev = (struct isc_device *)isc;
-    struct isc_send send;
-    struct isc_msg *m;
-    uint32_t sz;
-    bool ready;
     int rc;
 
-    if (!idev || !msg || !len)
-        return -1;
+    if (idev->opts.flags & ISC_OPT_RING)
+        bind->ver = ISC_PROTO_V2;
+    else
+        bind->ver = ISC_PROTO_V1;
 
-    if (!(idev->direct & ISC_DIR_SEND))
-        return -1;
+    /* plain binds keep the request number drivers have always known */
+    if (bind->ver == ISC_PROTO_V1 && !bind->feat) {
+        rc = isc_bind_v1(idev, bind);
+    } else {
+        rc = isc_dev->ioctl(idev->fd, ISC_IOCTL_BIND2, bind);
+        if (rc < 0 && (errno == ENOTTY || errno == EINVAL))
+            rc = isc_bind_v1(idev, bind);
+    }
+    if (rc < 0) {
+        LOGE("failed to ioctl ISC_IOCTL_BIND (rc=%s)\n", strerror(errno));
+        return rc;
+    }
 
-    pthread_mutex_lock(&idev->send_lock);
-    ready = idev->send_ready;
-    pthread_mutex_unlock(&idev->send_lock);
+    return isc_map_queue(idev, bind, q);
+}
 
-    if (!ready)
+static int isc_map_queue(struct isc_device *idev, struct isc_bind2 *bind,
+                         struct isc_queue *q)
+{
+    if (bind->ver == ISC_PROTO_V2 &&
+        (bind->ring < isc_slot_size(bind->msz, bind->feat & ISC_FEAT_TS) *
+                          bind->num ||
+         bind->ring + sizeof(struct isc_ring) > bind->size))
         return -1;
 
-    m = (struct isc_msg *)list_get(idev->sendq.wp, &sz);
-    if (sz < len)
+    q->mem = isc_dev->mmap(0, bind->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                           idev->fd, bind->mem);
+    if (q->mem == MAP_FAILED) {
+        q->mem = NULL;
         return -1;
+    }
+    q->size = bind->size;
+    if (bind->ver == ISC_PROTO_V2)
+        q->ring = (struct isc_ring *)((uint8_t *)q->mem + bind->ring);
+    if (!(bind->feat & ISC_FEAT_NODE))
+        isc_place_mem(q->mem, q->size, &idev->opts);
+    return 0;
+}
 
-    m->seq = idev->seq;
-    m->len = len;
-    m->flags &= ~ISC_MSG_FLAG_USER;
-    m->flags |= ISC_MSG_FLAG_USER;
-    memcpy(m->d, msg, len);
+/* the driver lays out the free list, nothing to touch here but the header */
+static int isc_map_buf(struct isc_device *idev)
+{
+    struct isc_buf_pool bp;
+    struct isc_buf_ctrl *b;
+    int rc;
 
-    memset(&send, 0, sizeof(send));
-    send.num = 1;
-    send.seq = idev->seq;
-    rc = ioctl(idev->fd, ISC_IOCTL_SEND, &send);
+    memset(&bp, 0, sizeof(bp));
+    bp.bsz = idev->opts.buf_size;
+    bp.num = idev->opts.buf_num;
+    bp.node = isc_mem_node(&idev->opts);
+    rc = isc_dev->ioctl(idev->fd, ISC_IOCTL_BUF_POOL, &bp);
     if (rc < 0) {
-        LOGE("failed to ioctl ISC_IOCTL_SEND (rc=%s)\n", strerror(errno));
+        LOGE("failed to ioctl ISC_IOCTL_BUF_POOL (rc=%s)\n", strerror(errno));
         return rc;
     }
 
-    *result = m->rc;
-    if (!m->rc)
-        memcpy(msg, m->d, len);
-    idev->sendq.wp = list_next(idev->sendq.wp);
-    idev->sendq.rp = list_next(idev->sendq.rp);
+    b = (struct isc_buf_ctrl *)isc_dev->mmap(0, bp.size,
+                                             PROT_READ | PROT_WRITE,
+                                             MAP_SHARED, idev->fd, bp.mem);
+    if (b == MAP_FAILED)
+        return -1;
 
-    idev->seq++;
-    return rc;
+    if (b->bsz < idev->opts.buf_size || !b->num ||
+        b->data < sizeof(*b) + b->num * sizeof(b->next[0]) ||
+        b->data + (uint64_t)b->num * b->bsz > bp.size) {
+        isc_dev->munmap(b, bp.size);
+        return -1;
+    }
+
+    idev->buf = b;
+    idev->buf_size = bp.size;
+    if (bp.node < 0)
+        isc_place_mem(b, bp.size, &idev->opts);
+    return 0;
 }
 
 static int isc_try_bind(struct isc_device *idev, uint32_t msz, uint32_t num,
                         bool is_send)
 {
-    struct isc_bind bind;
+    struct isc_bind2 bind;
     struct isc_queue *q;
     int rc;
 
@@ -371,26 +2278,36 @@ static int isc_try_bind(struct isc_device *idev, uint32_t msz, uint32_t num,
     bind.uid = idev->uid;
     bind.msz = msz;
     bind.num = num;
+    if (idev->opts.flags & ISC_OPT_TS)
+        bind.feat = ISC_FEAT_TS;
+    if (idev->opts.flags & ISC_OPT_REBIND)
+        bind.feat |= ISC_FEAT_KEEP;
+    /* session queues live in the pool, placed as a whole */
+    bind.node = isc_mem_node(&idev->opts);
+    if (bind.node >= 0 && !idev->sess)
+        bind.feat |= ISC_FEAT_NODE;
     if (is_send) {
         bind.dir = ISC_BIND_U_2_K;
         q = &idev->sendq;
     } else {
         bind.dir = ISC_BIND_K_2_U;
         q = &idev->recvq;
+        if (idev->opts.flags & ISC_OPT_MODERATE)
+            bind.feat |= ISC_FEAT_WANT;
     }
 
-    rc = ioctl(idev->fd, ISC_IOCTL_BIND, &bind);
-    if (rc < 0) {
-        LOGE("failed to ioctl ISC_IOCTL_BIND (rc=%s)\n", strerror(errno));
+    if (idev->sess)
+        rc = isc_chan_bind(idev, &bind, q);
+    else
+        rc = isc_map_bind(idev, &bind, q);
+    if (rc < 0)
         return rc;
-    }
-
-    if (bind.size < (msz + sizeof(struct isc_msg)) * num)
-        return -1;
 
-    q->mem = mmap(0, bind.size, PROT_READ | PROT_WRITE, MAP_SHARED, idev->fd,
-                  bind.mem);
-    if (q->mem == MAP_FAILED)
+    q->ts = bind.feat & ISC_FEAT_TS;
+    q->want = bind.ver == ISC_PROTO_V2 && (bind.feat & ISC_FEAT_WANT);
+    q->keep = bind.feat & ISC_FEAT_KEEP;
+    q->node = bind.feat & ISC_FEAT_NODE;
+    if (bind.size < isc_slot_size(msz, q->ts) * num)
         return -1;
 
     if (bind.stat == 1) {
@@ -406,6 +2323,55 @@ static int isc_try_bind(struct isc_device *idev, uint32_t msz, uint32_t num,
     return isc_create_queue(q, msz, num, q->mem);
 }
 
+/*
+ * Rebind a v2 queue with another depth at a quiescent point: the sendq
+ * with every slot reaped under send_lock, the recvq on the receive thread
+ * right after a drain. The driver moves what the recvq still holds to the
+ * front of the new queue, restarts the indices and sends no link event.
+ */
+static int isc_resize_queue(struct isc_device *idev, struct isc_queue *q,
+                            uint16_t dir, uint16_t num)
+{
+    struct isc_queue old = *q;
+    struct isc_bind2 bind;
+    int rc;
+
+    memset(&bind, 0, sizeof(bind));
+    bind.uid = idev->uid;
+    bind.msz = q->msz;
+    bind.num = num;
+    bind.dir = dir;
+    bind.ver = ISC_PROTO_V2;
+    bind.feat = isc_queue_feat(q);
+    bind.node = isc_mem_node(&idev->opts);
+    rc = isc_dev->ioctl(idev->fd, ISC_IOCTL_RESIZE, &bind);
+    if (rc < 0) {
+        if (errno == ENOTTY || errno == EINVAL)
+            q->fixed = true;
+        else if (errno != EBUSY)
+            LOGE("failed to ioctl ISC_IOCTL_RESIZE (rc=%s)\n",
+                 strerror(errno));
+        return rc;
+    }
+
+    if (bind.feat != isc_queue_feat(q))
+        rc = -1;
+    else
+        rc = isc_map_queue(idev, &bind, q);
+    if (rc < 0) {
+        /* the old queue is gone on the driver side */
+        LOGE("failed to map resized queue (uid=0x%08x)\n", idev->uid);
+        *q = old;
+        return rc;
+    }
+
+    isc_destroy_queue(&old);
+    isc_dev->munmap(old.mem, old.size);
+    q->done = 0;
+    q->stat.resizes++;
+    return isc_create_queue(q, q->msz, num, q->mem);
+}
+
 static struct list *isc_create_new_listener(const struct isc_listener_ops *ops,
                                             void *arg)
 {
@@ -447,7 +2413,7 @@ static int isc_add_listener(struct isc_handle *isc,
     if (!idev || !ops)
         return -1;
 
-    if (!ops->bound && !ops->unbind && !ops->got)
+    if (!ops->bound && !ops->unbind && !ops->got && !ops->oneway_failed)
         return -1;
 
     pthread_mutex_lock(&idev->listener_lock);
@@ -515,8 +2481,18 @@ _exit:
     return rc;
 }
 
+static const struct isc_opts isc_default_opts = {
+    .policy = SCHED_OTHER,
+};
+
 int open_isc(uint32_t uid, struct isc_attr *s, struct isc_attr *r,
              struct isc_handle **isc)
+{
+    return open_isc_ex(uid, s, r, NULL, isc);
+}
+
+int open_isc_ex(uint32_t uid, struct isc_attr *s, struct isc_attr *r,
+                const struct isc_opts *o, struct isc_handle **isc)
 {
     struct isc_device *idev;
     int fd;
@@ -532,29 +2508,24 @@ int open_isc(uint32_t uid, struct isc_attr *s, struct isc_attr *r,
     if (r)
         direct |= ISC_DIR_RECV;
 
-    fd = open(ISC_DEV_NAME, O_RDWR);
+    fd = isc_dev->open(ISC_DEV_NAME, O_RDWR);
     if (fd < 0)
         return -1;
 
     idev = (struct isc_device *)calloc(1, sizeof(*idev));
     if (!idev) {
-        close(fd);
+        isc_dev->close(fd);
         return -1;
     }
 
     idev->fd = fd;
     idev->uid = uid;
     idev->direct = direct;
+    idev->opts = o ? *o : isc_default_opts;
+    idev->opts.cpus = NULL;
 
     pthread_mutex_init(&idev->send_lock, NULL);
 
-    rc = isc_create_task(idev);
-    if (rc < 0) {
-        free(idev);
-        close(fd);
-        return rc;
-    }
-
     if (direct & ISC_DIR_RECV) {
         if (r->msz < sizeof(struct isc_int_msg))
             recv.msz = sizeof(struct isc_int_msg);
@@ -566,31 +2537,469 @@ int open_isc(uint32_t uid, struct isc_attr *s, struct isc_attr *r,
         recv.num = 8;
     }
 
-    rc = isc_try_bind(idev, recv.msz, recv.num, false);
-    if (rc < 0) {
-        isc_destroy_task(idev);
-        pthread_mutex_destroy(&idev->send_lock);
-        free(idev);
-        close(fd);
-        return rc;
+    /* idx % num must follow the free-running pull indices across a wrap */
+    if ((idev->opts.flags & ISC_OPT_PULL) && (recv.num & (recv.num - 1))) {
+        LOGE("ISC_OPT_PULL needs a power of 2 depth (num=%u)\n", recv.num);
+        rc = -1;
+        goto _unwind;
     }
 
+    rc = isc_try_bind(idev, recv.msz, recv.num, false);
+    if (rc < 0)
+        goto _unwind;
+
     if (direct & ISC_DIR_SEND) {
         rc = isc_try_bind(idev, s->msz, s->num, true);
-        if (rc < 0) {
-            isc_destroy_task(idev);
-            pthread_mutex_destroy(&idev->send_lock);
-            free(idev);
-            close(fd);
-            return rc;
+        if (rc < 0)
+            goto _unwind;
+    }
+
+    rc = isc_alloc_held(idev);
+    if (rc < 0)
+        goto _unwind;
+
+    if (idev->opts.flags & ISC_OPT_BUF) {
+        rc = isc_map_buf(idev);
+        if (rc < 0)
+            goto _unwind;
+    }
+
+    if (idev->opts.flags & ISC_OPT_PULL) {
+        idev->pull.done = (uint64_t *)calloc(idev->recvq.num,
+                                             sizeof(*idev->pull.done));
+        if (!idev->pull.done) {
+            rc = -1;
+            goto _unwind;
+        }
+        pthread_mutex_init(&idev->pull.lock, NULL);
+    }
+
+    /* started after binding, the thread picks the recvq protocol once */
+    rc = isc_create_task(&idev->task, isc_task_handler, idev,
+                         o ? o : &isc_default_opts);
+    if (rc < 0)
+        goto _unwind;
+
+    idev->isc.close = isc_close;
+    idev->isc.send = isc_send_msg;
+    idev->isc.send_oneway = isc_send_oneway;
+    idev->isc.oneway_errors = isc_oneway_errors;
+    idev->isc.buf_alloc = isc_buf_alloc;
+    idev->isc.buf_free = isc_buf_free;
+    idev->isc.send_buf = isc_send_buf;
+    idev->isc.recv_many = isc_recv_many;
+    idev->isc.recv = isc_recv;
+    idev->isc.release = isc_release;
+    idev->isc.queue_stat = isc_queue_stat;
+    idev->isc.delay_stat = isc_delay_stat;
+    idev->isc.add_listener = isc_add_listener;
+    idev->isc.rm_listener = isc_rm_listener;
+
+    *isc = &idev->isc;
+    return 0;
+
+_unwind:
+    isc_unmap(idev);
+    pthread_mutex_destroy(&idev->send_lock);
+    free(idev->held);
+    free(idev->failed);
+    free(idev);
+    isc_dev->close(fd);
+    return rc;
+}
+
+static void isc_session_ack(struct isc_sess *sess, uint32_t ch, uint16_t seq,
+                            uint16_t num)
+{
+    struct isc_chan_xfer x;
+    int rc;
+
+    memset(&x, 0, sizeof(x));
+    x.ch = ch;
+    x.seq = seq;
+    x.num = num;
+    rc = isc_dev->ioctl(sess->fd, ISC_IOCTL_CH_RECV, &x);
+    if (rc < 0)
+        LOGE("failed to ioctl ISC_IOCTL_CH_RECV (rc=%s)\n", strerror(errno));
+}
+
+static void isc_session_drain(struct isc_sess *sess, struct isc_device *idev)
+{
+    struct isc_msg *m;
+    uint32_t posted, n, i;
+    uint16_t seq = 0;
+
+    posted = __atomic_load_n(&sess->ctrl->posted[idev->ch], __ATOMIC_ACQUIRE);
+    n = posted - idev->recvq.done;
+    if (!n || !idev->recvq.rp)
+        return;
+    isc_track(&idev->recvq, n, n);
+
+    for (i = 0; i < n; i++) {
+        m = (struct isc_msg *)list_get(idev->recvq.rp, NULL);
+        if (!i)
+            seq = m->seq;
+        isc_handle_msg(idev, m);
+        idev->recvq.rp = list_next(idev->recvq.rp);
+    }
+
+    /* one ack for the whole batch, by the seq of its first message */
+    isc_session_ack(sess, idev->ch, seq, n);
+    idev->recvq.done = posted;
+}
+
+static void isc_session_dispatch(struct isc_sess *sess)
+{
+    struct isc_pool_ctrl *ctrl = sess->ctrl;
+    struct isc_device *idev;
+    uint32_t w, ch, stat;
+    uint64_t bits;
+
+    for (w = 0; w < ARRAY_SIZE(ctrl->event); w++) {
+        bits = __atomic_exchange_n(&ctrl->event[w], 0, __ATOMIC_ACQ_REL);
+        while (bits) {
+            ch = w * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            isc_session_ack(sess, ch, 0, 0);
+            stat = __atomic_load_n(&ctrl->stat[ch], __ATOMIC_ACQUIRE);
+            pthread_mutex_lock(&sess->lock);
+            idev = sess->chans[ch];
+            if (idev)
+                isc_set_link(idev, stat == 1);
+            pthread_mutex_unlock(&sess->lock);
+        }
+    }
+
+    for (w = 0; w < ARRAY_SIZE(ctrl->ready); w++) {
+        bits = __atomic_exchange_n(&ctrl->ready[w], 0, __ATOMIC_ACQ_REL);
+        while (bits) {
+            ch = w * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            pthread_mutex_lock(&sess->lock);
+            idev = sess->chans[ch];
+            if (idev)
+                isc_session_drain(sess, idev);
+            pthread_mutex_unlock(&sess->lock);
+        }
+    }
+}
+
+static void *isc_session_task_handler(void *arg)
+{
+    struct isc_sess *sess = (struct isc_sess *)arg;
+    struct pollfd fds[2];
+    uint64_t u;
+    ssize_t rn;
+    int rc;
+    bool mod;
+
+    if (!sess)
+        return NULL;
+
+    memset(fds, 0, sizeof(fds));
+    fds[0].fd = sess->fd;
+    fds[1].fd = sess->task.efd;
+    fds[0].events = POLLIN;
+    fds[1].events = POLLIN;
+    mod = isc_moderated(&sess->opts);
+
+    while (sess->task.is_started) {
+        fds[1].revents = 0;
+        rc = poll(fds, ARRAY_SIZE(fds), -1);
+        if (rc <= 0)
+            continue;
+        if (fds[1].revents & POLLIN) {
+            rn = read(sess->task.efd, &u, sizeof(u));
+            (void)rn;
+        } else if (mod) {
+            /* one dispatch pass serves every channel that got messages */
+            isc_sleep_until(&fds[1], 1,
+                            isc_clock_ns(CLOCK_MONOTONIC) +
+                                sess->opts.mod_usecs * 1000ull);
         }
+        isc_session_dispatch(sess);
+    }
+    return NULL;
+}
+
+static int isc_session_open(struct isc_session *session, uint32_t uid,
+                            struct isc_attr *s, struct isc_attr *r,
+                            const struct isc_opts *o, struct isc_handle **isc)
+{
+    struct isc_sess *sess = (struct isc_sess *)session;
+    struct isc_device *idev;
+    uint32_t w, stat;
+    uint16_t msz;
+    int rc;
+
+    if (!sess || !isc || (!s && !r))
+        return -1;
+
+    if (o && (o->flags & ISC_SESS_NO_OPTS)) {
+        LOGE("session handles take neither ISC_OPT_BUF nor ISC_OPT_PULL "
+             "(uid=0x%08x)\n", uid);
+        return -1;
+    }
+
+    idev = (struct isc_device *)calloc(1, sizeof(*idev));
+    if (!idev)
+        return -1;
+
+    idev->sess = sess;
+    idev->fd = sess->fd;
+    idev->uid = uid;
+    idev->opts = o ? *o : isc_default_opts;
+    idev->opts.cpus = NULL;
+    idev->ch = ISC_SESSION_MAX;
+    if (s)
+        idev->direct |= ISC_DIR_SEND;
+    if (r)
+        idev->direct |= ISC_DIR_RECV;
+
+    pthread_mutex_init(&idev->send_lock, NULL);
+
+    /* send-only channels get link changes from the pool, not from a recvq */
+    if (r) {
+        msz = r->msz;
+        if (msz < sizeof(struct isc_int_msg))
+            msz = sizeof(struct isc_int_msg);
+        rc = isc_try_bind(idev, msz, r->num, false);
+        if (rc < 0)
+            goto _fail;
     }
 
+    if (s) {
+        rc = isc_try_bind(idev, s->msz, s->num, true);
+        if (rc < 0)
+            goto _fail;
+    }
+
+    rc = isc_alloc_held(idev);
+    if (rc < 0)
+        goto _fail;
+
     idev->isc.close = isc_close;
     idev->isc.send = isc_send_msg;
+    idev->isc.send_oneway = isc_send_oneway;
+    idev->isc.oneway_errors = isc_oneway_errors;
+    idev->isc.buf_alloc = isc_buf_alloc;
+    idev->isc.buf_free = isc_buf_free;
+    idev->isc.send_buf = isc_send_buf;
+    idev->isc.recv_many = isc_recv_many;
+    idev->isc.recv = isc_recv;
+    idev->isc.release = isc_release;
+    idev->isc.queue_stat = isc_queue_stat;
+    idev->isc.delay_stat = isc_delay_stat;
     idev->isc.add_listener = isc_add_listener;
     idev->isc.rm_listener = isc_rm_listener;
 
+    pthread_mutex_lock(&sess->lock);
+    if (sess->chans[idev->ch]) {
+        pthread_mutex_unlock(&sess->lock);
+        idev->ch = ISC_SESSION_MAX;
+        rc = -1;
+        goto _fail;
+    }
+    sess->chans[idev->ch] = idev;
+    stat = __atomic_load_n(&sess->ctrl->stat[idev->ch], __ATOMIC_ACQUIRE);
+    if ((stat == 1) != (idev->send_ready || idev->recv_ready))
+        isc_set_link(idev, stat == 1);
+    pthread_mutex_unlock(&sess->lock);
+
+    /* pick up whatever was posted before the channel was registered */
+    w = idev->ch / 64;
+    __atomic_or_fetch(&sess->ctrl->ready[w], 1ull << (idev->ch % 64),
+                      __ATOMIC_RELEASE);
+    isc_wake_task(&sess->task);
+
     *isc = &idev->isc;
     return 0;
+
+_fail:
+    isc_chan_close(idev);
+    return rc;
+}
+
+static void isc_session_close(struct isc_session *session)
+{
+    struct isc_sess *sess = (struct isc_sess *)session;
+    struct isc_device *idev;
+    int rc, noarg = 0;
+    uint32_t i;
+
+    if (!sess)
+        return;
+
+    isc_destroy_task(&sess->task);
+
+    for (i = 0; i < ISC_SESSION_MAX; i++) {
+        pthread_mutex_lock(&sess->lock);
+        idev = sess->chans[i];
+        pthread_mutex_unlock(&sess->lock);
+        if (idev)
+            isc_chan_close(idev);
+    }
+
+    isc_dev->munmap(sess->mem, sess->size);
+
+    rc = isc_dev->ioctl(sess->fd, ISC_IOCTL_CLOSE, &noarg);
+    if (rc < 0)
+        LOGE("failed to ioctl ISC_IOCTL_CLOSE (rc=%s)\n", strerror(errno));
+
+    pthread_mutex_destroy(&sess->lock);
+    isc_dev->close(sess->fd);
+    free(sess);
+}
+
+int open_isc_session(uint32_t size, const struct isc_opts *o,
+                     struct isc_session **session)
+{
+    struct isc_sess *sess;
+    struct isc_pool pool;
+    int rc;
+
+    if (!session || !size)
+        return -1;
+
+    if (o && (o->flags & ISC_SESS_NO_OPTS)) {
+        LOGE("sessions take neither ISC_OPT_BUF nor ISC_OPT_PULL\n");
+        return -1;
+    }
+
+    sess = (struct isc_sess *)calloc(1, sizeof(*sess));
+    if (!sess)
+        return -1;
+
+    sess->opts = o ? *o : isc_default_opts;
+    sess->opts.cpus = NULL;
+
+    sess->fd = isc_dev->open(ISC_DEV_NAME, O_RDWR);
+    if (sess->fd < 0) {
+        free(sess);
+        return -1;
+    }
+
+    memset(&pool, 0, sizeof(pool));
+    pool.size = size;
+    pool.node = isc_mem_node(&sess->opts);
+    rc = isc_dev->ioctl(sess->fd, ISC_IOCTL_POOL, &pool);
+    if (rc < 0) {
+        LOGE("failed to ioctl ISC_IOCTL_POOL (rc=%s)\n", strerror(errno));
+        goto _close_fd;
+    }
+
+    rc = -1;
+    if (pool.size < sizeof(struct isc_pool_ctrl) + size)
+        goto _close_fd;
+
+    sess->mem = (uint8_t *)isc_dev->mmap(0, pool.size, PROT_READ | PROT_WRITE,
+                                         MAP_SHARED, sess->fd, pool.mem);
+    if (sess->mem == (uint8_t *)MAP_FAILED)
+        goto _close_fd;
+    sess->size = pool.size;
+    sess->ctrl = (struct isc_pool_ctrl *)sess->mem;
+    if (pool.node < 0)
+        isc_place_mem(sess->mem, sess->size, &sess->opts);
+
+    pthread_mutex_init(&sess->lock, NULL);
+
+    rc = isc_create_task(&sess->task, isc_session_task_handler, sess,
+                         o ? o : &isc_default_opts);
+    if (rc < 0)
+        goto _unmap;
+
+    sess->session.close = isc_session_close;
+    sess->session.open = isc_session_open;
+
+    *session = &sess->session;
+    return 0;
+
+_unmap:
+    pthread_mutex_destroy(&sess->lock);
+    isc_dev->munmap(sess->mem, sess->size);
+_close_fd:
+    isc_dev->close(sess->fd);
+    free(sess);
+    return rc;
+}
+
+int isc_capture_start(const char *path, size_t size)
+{
+    struct isc_cap_hdr *h;
+    int fd, err, rc = -1;
+
+    if (!path || size <= sizeof(*h))
+        return -1;
+
+    pthread_mutex_lock(&isc_cap_lock);
+    if (isc_cap)
+        goto _exit;
+
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        LOGE("failed to open %s (rc=%s)\n", path, strerror(errno));
+        goto _exit;
+    }
+
+    /*
+     * Allocate the blocks and fault the pages in up front, so recording a
+     * message never waits for the file system on the send or receive path.
+     */
+    err = posix_fallocate(fd, 0, size);
+    if (err) {
+        LOGE("failed to allocate %s (rc=%s)\n", path, strerror(err));
+        close(fd);
+        goto _exit;
+    }
+
+    h = (struct isc_cap_hdr *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                   MAP_SHARED | MAP_POPULATE, fd, 0);
+    if (h == MAP_FAILED) {
+        LOGE("failed to mmap %s (rc=%s)\n", path, strerror(errno));
+        close(fd);
+        goto _exit;
+    }
+
+    h->magic = ISC_CAP_MAGIC;
+    h->version = ISC_CAP_VERSION;
+    h->size = size - sizeof(*h);
+    h->mono_ns = isc_clock_ns(CLOCK_MONOTONIC);
+    h->real_ns = isc_clock_ns(CLOCK_REALTIME);
+
+    isc_cap_fd = fd;
+    __atomic_store_n(&isc_cap, h, __ATOMIC_SEQ_CST);
+    rc = 0;
+
+_exit:
+    pthread_mutex_unlock(&isc_cap_lock);
+    return rc;
+}
+
+void isc_capture_stop(void)
+{
+    struct isc_cap_hdr *h;
+    size_t munmap_size;
+    uint64_t used;
+
+    pthread_mutex_lock(&isc_cap_lock);
+    h = __atomic_exchange_n(&isc_cap, NULL, __ATOMIC_SEQ_CST);
+    if (!h) {
+        pthread_mutex_unlock(&isc_cap_lock);
+        return;
+    }
+
+    while (__atomic_load_n(&isc_cap_users, __ATOMIC_ACQUIRE))
+        sched_yield();
+
+    /* leave a file whose header matches its length */
+    used = h->used < h->size ? h->used : h->size;
+    munmap_size = h->size + sizeof(*h);
+    h->size = used;
+    h->used = used;
+    munmap(h, munmap_size);
+    if (ftruncate(isc_cap_fd, used + sizeof(*h)) < 0)
+        LOGE("failed to trim capture (rc=%s)\n", strerror(errno));
+    close(isc_cap_fd);
+    isc_cap_fd = -1;
+    pthread_mutex_unlock(&isc_cap_lock);
 }
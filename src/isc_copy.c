@@ -0,0 +1,215 @@
+// See LICENSE for license details.
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "isc_copy.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ISC_COPY_X86
+#endif
+
+#ifdef ISC_COPY_X86
+/*
+ * Each kernel aligns the destination with a plain copy of the head, streams
+ * whole unrolled blocks with unaligned loads and copies the tail plainly.
+ * Streaming stores are weakly ordered, the sfence makes them visible before
+ * the caller publishes the slot.
+ */
+__attribute__((target("sse2"))) static void
+isc_copy_sse2(void *dst, const void *src, size_t len)
+{
+    size_t head = -(uintptr_t)dst & 15;
+    const uint8_t *s = (const uint8_t *)src;
+    uint8_t *d = (uint8_t *)dst;
+    __m128i a, b, c, e;
+
+    if (len < head + 64) {
+        memcpy(d, s, len);
+        return;
+    }
+
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    len -= head;
+    for (; len >= 64; len -= 64, d += 64, s += 64) {
+        a = _mm_loadu_si128((const __m128i *)s);
+        b = _mm_loadu_si128((const __m128i *)(s + 16));
+        c = _mm_loadu_si128((const __m128i *)(s + 32));
+        e = _mm_loadu_si128((const __m128i *)(s + 48));
+        _mm_stream_si128((__m128i *)d, a);
+        _mm_stream_si128((__m128i *)(d + 16), b);
+        _mm_stream_si128((__m128i *)(d + 32), c);
+        _mm_stream_si128((__m128i *)(d + 48), e);
+    }
+    _mm_sfence();
+    memcpy(d, s, len);
+}
+
+__attribute__((target("avx2"))) static void
+isc_copy_avx2(void *dst, const void *src, size_t len)
+{
+    size_t head = -(uintptr_t)dst & 31;
+    const uint8_t *s = (const uint8_t *)src;
+    uint8_t *d = (uint8_t *)dst;
+    __m256i a, b, c, e;
+
+    if (len < head + 128) {
+        memcpy(d, s, len);
+        return;
+    }
+
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    len -= head;
+    for (; len >= 128; len -= 128, d += 128, s += 128) {
+        a = _mm256_loadu_si256((const __m256i *)s);
+        b = _mm256_loadu_si256((const __m256i *)(s + 32));
+        c = _mm256_loadu_si256((const __m256i *)(s + 64));
+        e = _mm256_loadu_si256((const __m256i *)(s + 96));
+        _mm256_stream_si256((__m256i *)d, a);
+        _mm256_stream_si256((__m256i *)(d + 32), b);
+        _mm256_stream_si256((__m256i *)(d + 64), c);
+        _mm256_stream_si256((__m256i *)(d + 96), e);
+    }
+    _mm_sfence();
+    /* no AVX-SSE transition penalty in the memcpy() of the tail */
+    _mm256_zeroupper();
+    memcpy(d, s, len);
+}
+
+__attribute__((target("avx512f"))) static void
+isc_copy_avx512(void *dst, const void *src, size_t len)
+{
+    size_t head = -(uintptr_t)dst & 63;
+    const uint8_t *s = (const uint8_t *)src;
+    uint8_t *d = (uint8_t *)dst;
+    __m512i a, b, c, e;
+
+    if (len < head + 256) {
+        memcpy(d, s, len);
+        return;
+    }
+
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    len -= head;
+    for (; len >= 256; len -= 256, d += 256, s += 256) {
+        a = _mm512_loadu_si512((const void *)s);
+        b = _mm512_loadu_si512((const void *)(s + 64));
+        c = _mm512_loadu_si512((const void *)(s + 128));
+        e = _mm512_loadu_si512((const void *)(s + 192));
+        _mm512_stream_si512((void *)d, a);
+        _mm512_stream_si512((void *)(d + 64), b);
+        _mm512_stream_si512((void *)(d + 128), c);
+        _mm512_stream_si512((void *)(d + 192), e);
+    }
+    _mm_sfence();
+    _mm256_zeroupper();
+    memcpy(d, s, len);
+}
+#endif
+
+static void isc_copy_libc(void *dst, const void *src, size_t len)
+{
+    memcpy(dst, src, len);
+}
+
+static const char *const isc_copy_names[ISC_COPY_KINDS] = {
+    [ISC_COPY_LIBC] = "libc",
+    [ISC_COPY_SSE2] = "sse2",
+    [ISC_COPY_AVX2] = "avx2",
+    [ISC_COPY_AVX512] = "avx512",
+};
+
+static bool isc_copy_runs(enum isc_copy_kind kind)
+{
+#ifdef ISC_COPY_X86
+    __builtin_cpu_init();
+    switch (kind) {
+    case ISC_COPY_SSE2:
+        return __builtin_cpu_supports("sse2");
+    case ISC_COPY_AVX2:
+        return __builtin_cpu_supports("avx2");
+    case ISC_COPY_AVX512:
+        return __builtin_cpu_supports("avx512f");
+    default:
+        break;
+    }
+#endif
+    return kind == ISC_COPY_LIBC;
+}
+
+isc_copy_fn isc_copy_kernel(enum isc_copy_kind kind)
+{
+    if (kind >= ISC_COPY_KINDS || !isc_copy_runs(kind))
+        return NULL;
+
+    switch (kind) {
+#ifdef ISC_COPY_X86
+    case ISC_COPY_SSE2:
+        return isc_copy_sse2;
+    case ISC_COPY_AVX2:
+        return isc_copy_avx2;
+    case ISC_COPY_AVX512:
+        return isc_copy_avx512;
+#endif
+    default:
+        return isc_copy_libc;
+    }
+}
+
+const char *isc_copy_name(enum isc_copy_kind kind)
+{
+    return kind < ISC_COPY_KINDS ? isc_copy_names[kind] : "unknown";
+}
+
+/*
+ * Streaming is off by default, every entry is the ISC_COPY_NT_NEVER
+ * sentinel. Where a kernel beats memcpy() depends on the queue depth and
+ * the sender's working set (see README): AVX-512 anywhere from 32K to 256K,
+ * SSE2 not at all, so no single size holds for every user. An entry gets a
+ * size only once measurements back it for all of them.
+ */
+static const uint32_t isc_copy_nt_mins[ISC_COPY_KINDS] = {
+    [ISC_COPY_LIBC] = ISC_COPY_NT_NEVER,
+    [ISC_COPY_SSE2] = ISC_COPY_NT_NEVER,
+    [ISC_COPY_AVX2] = ISC_COPY_NT_NEVER,
+    [ISC_COPY_AVX512] = ISC_COPY_NT_NEVER,
+};
+
+/* 0 until picked, kind + 1 after, racing first callers agree on it */
+static uint32_t isc_copy_picked;
+static isc_copy_fn isc_copy_fast;
+
+enum isc_copy_kind isc_copy_best(void)
+{
+    uint32_t k = __atomic_load_n(&isc_copy_picked, __ATOMIC_ACQUIRE);
+
+    if (k)
+        return (enum isc_copy_kind)(k - 1);
+
+    for (k = ISC_COPY_KINDS - 1; k > ISC_COPY_LIBC; k--)
+        if (isc_copy_runs((enum isc_copy_kind)k))
+            break;
+    __atomic_store_n(&isc_copy_fast, isc_copy_kernel((enum isc_copy_kind)k),
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&isc_copy_picked, k + 1, __ATOMIC_RELEASE);
+    return (enum isc_copy_kind)k;
+}
+
+uint32_t isc_copy_nt_min(void)
+{
+    return isc_copy_nt_mins[isc_copy_best()];
+}
+
+void isc_copy_nt(void *dst, const void *src, size_t len)
+{
+    if (!__atomic_load_n(&isc_copy_picked, __ATOMIC_ACQUIRE))
+        isc_copy_best();
+    isc_copy_fast(dst, src, len);
+}